@@ -0,0 +1,97 @@
+// Choosing from a weighted list in constant time.
+//
+// To choose i from 0 to n - 1 with probability proportional to weight[i],
+// std::discrete_distribution does a binary search on every draw, and has to
+// be built again whenever the weights change. An alias table (Walker's
+// method, set up with Vose's algorithm) takes O(n) to build and then O(1) per
+// draw: pick a column i uniformly, and keep it with probability
+// probability[i], or else take alias[i] instead. Each column's probability
+// plus what the other columns alias to it adds up to weight[i] / mean weight.
+//
+// One uniform random number does for both choices: its integer part picks
+// the column and its fractional part decides between the column and its
+// alias.
+//
+// build() remembers the weights, and doesn't do anything if it's given the
+// same weights again, so it's cheap to call it every step in case they've
+// changed. After the first build with n weights it doesn't allocate anything.
+
+#ifndef TUTSIM_ALIAS_HH
+#define TUTSIM_ALIAS_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <random>
+#include <vector>
+
+class AliasTable {
+public:
+  std::vector<double> weights; // As last given to build()
+  std::vector<double> probability;
+  std::vector<unsigned> alias;
+
+  size_t size() const
+  {
+    return weights.size();
+  }
+
+  // Set up the table for choosing from weights[0] to weights[n - 1]. If
+  // they're all 0, every choice is equally likely. Returns false if the
+  // weights are the same as last time, so there was nothing to do.
+  bool build(const double *weights, const size_t n)
+  {
+    if (n == this->weights.size()
+	&& std::equal(weights, weights + n, this->weights.begin()))
+      return false;
+    this->weights.assign(weights, weights + n);
+    probability.resize(n);
+    alias.resize(n);
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i)
+      sum += weights[i];
+    // Scale so that the average column is 1, and sort the columns into
+    // those under and over it
+    small.clear();
+    large.clear();
+    small.reserve(n); // So that later builds don't allocate
+    large.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+      probability[i] = sum > 0.0 ? weights[i] * n / sum : 1.0;
+      alias[i] = i;
+      (probability[i] < 1.0 ? small : large).push_back(i);
+    }
+    // Fill up each small column from a large one, which may then become
+    // small itself
+    while (!small.empty() && !large.empty()) {
+      unsigned s = small.back(), l = large.back();
+      small.pop_back();
+      alias[s] = l;
+      probability[l] -= 1.0 - probability[s];
+      if (probability[l] < 1.0) {
+	large.pop_back();
+	small.push_back(l);
+      }
+    }
+    // Whatever's left is 1 but for rounding errors
+    for (auto i : small)
+      probability[i] = 1.0;
+    for (auto i : large)
+      probability[i] = 1.0;
+    return true;
+  }
+
+  // A random choice from 0 to size() - 1. The table mustn't be empty.
+  template <class Generator> unsigned sample(Generator& generator) const
+  {
+    const size_t n = size();
+    std::uniform_real_distribution<double> dist(0.0, n);
+    double x = dist(generator);
+    size_t i = std::min<size_t>(x, n - 1);
+    return x - i < probability[i] ? i : alias[i];
+  }
+
+private:
+  std::vector<unsigned> small, large; // Work space for build()
+};
+
+#endif
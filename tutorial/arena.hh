@@ -0,0 +1,120 @@
+// Scratch memory for the simulation's time steps.
+//
+// Anything that needs temporary space during a step (the shares and
+// prevalences in Mixing::update_force(), the partial summaries and threads in
+// summarize(), the sorted values in Sketch::quantile()) would otherwise get it
+// from the heap and give it back, on every step. Instead each Engine has an
+// Arena per thread. Taking space from an arena just moves a pointer along,
+// and nothing is given back until the Engine resets the arenas at the end of
+// the step. The first few steps find out how much space a step needs; after
+// that a step doesn't allocate anything.
+//
+// Nothing's destructor is called when an arena is reset, so only keep plain
+// data in it, or use ArenaAllocator with an STL container that goes out of
+// scope before the reset.
+
+#ifndef TUTSIM_ARENA_HH
+#define TUTSIM_ARENA_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+class Arena {
+public:
+  // Memory is taken from the heap in blocks of at least this many bytes.
+  // It's an enum rather than a static const so that std::max can take it by
+  // reference without it having to be defined outside the class.
+  enum : size_t { MIN_BLOCK = 64 * 1024 };
+
+  size_t allocations = 0; // Number of blocks taken from the heap, ever
+
+  Arena() {}
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  Arena(Arena&&) = default;
+  Arena& operator=(Arena&&) = default;
+
+  // Space for n Ts, aligned for T. It isn't initialised.
+  template <class T> T *allocate(const size_t n)
+  {
+    return static_cast<T *>(allocate_bytes(n * sizeof(T), alignof(T)));
+  }
+
+  void *allocate_bytes(const size_t bytes, const size_t align)
+  {
+    size_t start = (used + align - 1) / align * align;
+    if (blocks.empty() || start + bytes > sizes.back()) {
+      // Start a new block. The old ones are kept until reset(), since there
+      // may still be things in them.
+      new_block(std::max<size_t>(MIN_BLOCK, bytes + align));
+      start = (used + align - 1) / align * align;
+    }
+    used = start + bytes;
+    total += bytes;
+    return blocks.back().get() + start;
+  }
+
+  // Make all the space available again. If the last step needed more than
+  // one block, they're replaced with one block big enough for all of it, so
+  // that next time one will do.
+  void reset()
+  {
+    if (blocks.size() > 1) {
+      size_t size = 0;
+      for (auto s : sizes)
+	size += s;
+      blocks.clear();
+      sizes.clear();
+      new_block(size);
+    }
+    used = 0;
+    total = 0;
+  }
+
+  // Number of bytes handed out since the last reset
+  size_t in_use() const { return total; }
+
+private:
+  std::vector<std::unique_ptr<char[]> > blocks;
+  std::vector<size_t> sizes;
+  size_t used = 0; // Bytes used in the last block
+  size_t total = 0;
+
+  void new_block(const size_t size)
+  {
+    blocks.push_back(std::unique_ptr<char[]>(new char[size]));
+    sizes.push_back(size);
+    used = 0;
+    ++allocations;
+  }
+};
+
+// So that STL containers can use an arena, e.g.
+//   std::vector<double, ArenaAllocator<double> > v(n, 0.0, scratch);
+// Deallocating does nothing; the space is reused after the arena is reset.
+template <class T>
+class ArenaAllocator {
+public:
+  typedef T value_type;
+  Arena *arena;
+
+  ArenaAllocator(Arena& arena) : arena(&arena) {}
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+  T *allocate(const size_t n) { return arena->allocate<T>(n); }
+  void deallocate(T *, size_t) {}
+
+  template <class U> bool operator==(const ArenaAllocator<U>& other) const
+  {
+    return arena == other.arena;
+  }
+  template <class U> bool operator!=(const ArenaAllocator<U>& other) const
+  {
+    return arena != other.arena;
+  }
+};
+
+#endif
@@ -0,0 +1,324 @@
+// Fitting parameters to observed prevalence by Approximate Bayesian
+// Computation.
+//
+// We want the values of some parameters (say RATE_NEW_PARTNER and
+// FORCE_INFECTION) that make the simulation reproduce the prevalence observed
+// on some dates. There's no likelihood to write down, but we can simulate:
+// ABC keeps the parameter values whose simulations come within a tolerance of
+// the data, and the kept values are a sample from (an approximation to) the
+// posterior distribution.
+//
+// Calibration does ABC-SMC (sequential Monte Carlo, after Beaumont et al.
+// 2009). Generation 0 takes num_particles values from the priors, which are
+// uniform, and simulates each. Each later generation sets its tolerance to
+// the given quantile of the last generation's distances, and fills each of
+// its num_particles slots by choosing a particle of the last generation (by
+// weight, from an alias table; see alias.hh), moving it by a normal kernel
+// with twice the variance of that generation, and simulating, until a
+// simulation comes within the tolerance. The new particle's weight makes up
+// for it having been proposed this way rather than drawn from the prior.
+//
+// The distance is the root mean square of the differences from the targets,
+// and it's added up during the run: after each step, any target dates that
+// have been passed are compared with the prevalence (interpolated between
+// the steps either side, as tutbench does). The sum only grows, so as soon as
+// it's more than the tolerance allows, the run can't be accepted and is
+// stopped. Most bad proposals go wrong early, so this saves most of the
+// simulating. The run also stops at the last target date.
+//
+// The slots are shared out between num_threads threads, each running its own
+// Engine with one thread. Each slot has its own random numbers, seeded from
+// seed, the generation and the slot, so the results don't depend on the
+// number of threads.
+
+#ifndef TUTSIM_CALIBRATE_HH
+#define TUTSIM_CALIBRATE_HH
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "alias.hh"
+#include "tutsim.hh"
+
+struct Prior {
+  std::string name; // Of the parameter
+  double low, high; // It's uniform between these
+};
+
+struct Target {
+  double date;
+  double prevalence;
+};
+
+struct Particle {
+  std::vector<double> values; // One for each prior
+  double distance;
+  double weight;
+};
+
+class Calibration {
+public:
+  std::vector<Prior> priors;
+  std::vector<Target> targets; // In date order
+  // Other parameters to set in every simulation
+  std::vector<std::pair<std::string, double> > parameters;
+  unsigned num_particles = 100;
+  double quantile = 0.5; // Of the distances, for the next tolerance
+  unsigned max_attempts = 1000; // For each slot, before giving up
+  unsigned num_threads = 1;
+  unsigned seed = 1;
+  // The last generation
+  unsigned generation = 0;
+  double tolerance = std::numeric_limits<double>::infinity();
+  std::vector<Particle> particles;
+  // How the last generation went
+  size_t attempts = 0; // Simulations started
+  size_t steps = 0; // Steps simulated
+  size_t stopped = 0; // Simulations stopped early
+  size_t full_steps = 0; // Steps in a simulation that isn't stopped
+
+  // Run generation 0. Returns false if something's wrong.
+  bool start()
+  {
+    if (priors.empty() || targets.empty() || num_particles == 0)
+      return false;
+    generation = 0;
+    tolerance = std::numeric_limits<double>::infinity();
+    return run();
+  }
+
+  // Run the next generation. Returns false if any slot couldn't be filled
+  // in max_attempts simulations, in which case the last generation is kept.
+  bool next()
+  {
+    std::vector<double> distances;
+    for (auto &p : particles)
+      distances.push_back(p.distance);
+    size_t k = std::min<size_t>(distances.size() - 1,
+				quantile * distances.size());
+    std::nth_element(distances.begin(), distances.begin() + k,
+		     distances.end());
+    const double last_tolerance = tolerance;
+    tolerance = distances[k];
+    ++generation;
+    if (run())
+      return true;
+    --generation;
+    tolerance = last_tolerance;
+    return false;
+  }
+
+  // Weighted mean and standard deviation of the i-th parameter in the last
+  // generation
+  double mean(const size_t i) const
+  {
+    return mean(particles, i);
+  }
+
+  double sd(const size_t i) const
+  {
+    return sd(particles, i);
+  }
+
+  // Simulate with the given values, stopping once the distance is sure to
+  // be more than tolerance. Returns the distance, or infinity if stopped.
+  // steps is set to the number of steps simulated.
+  double distance(const std::vector<double>& values, const unsigned seed,
+		  const double tolerance, size_t& steps) const
+  {
+    Engine engine;
+    engine.reporter.out = nullptr;
+    for (auto &p : parameters)
+      set_parameter(engine.parameters, p.first, p.second);
+    engine.parameters["NUM_THREADS"] = 1; // The particles are in parallel
+    engine.parameters["NUM_SHARDS"] = 1;
+    for (size_t i = 0; i < priors.size(); ++i)
+      set_parameter(engine.parameters, priors[i].name, values[i]);
+    engine.parameters["SEED"] = seed;
+    engine.parameters["NUM_YEARS"] = targets.back().date
+      - engine.parameters["START_DATE"] + engine.parameters["TIME_STEP"];
+    engine.create();
+    engine.start();
+    // Stop when the sum of squares is more than this
+    const double limit = tolerance * tolerance * targets.size();
+    double sum = 0.0;
+    double last_date = engine.date();
+    double last_prevalence = engine.prevalence();
+    size_t next = 0;
+    while (next < targets.size() && targets[next].date < last_date - 1e-9)
+      ++next; // Before the start, so they can't be compared
+    steps = 0;
+    while (next < targets.size() && engine.step()) {
+      ++steps;
+      double date = engine.date();
+      double prevalence = engine.prevalence();
+      while (next < targets.size() && targets[next].date <= date + 1e-9) {
+	double w = (targets[next].date - last_date) / (date - last_date);
+	double error = last_prevalence + w * (prevalence - last_prevalence)
+	  - targets[next].prevalence;
+	sum += error * error;
+	++next;
+      }
+      if (sum > limit)
+	return std::numeric_limits<double>::infinity();
+      last_date = date;
+      last_prevalence = prevalence;
+    }
+    return sqrt(sum / targets.size());
+  }
+
+private:
+  // The previous generation, and the standard deviation of the kernel for
+  // each parameter
+  std::vector<Particle> previous;
+  std::vector<double> kernel;
+  AliasTable choices;
+
+  static double mean(const std::vector<Particle>& particles, const size_t i)
+  {
+    double sum = 0.0;
+    for (auto &p : particles)
+      sum += p.weight * p.values[i];
+    return sum;
+  }
+
+  static double sd(const std::vector<Particle>& particles, const size_t i)
+  {
+    const double m = mean(particles, i);
+    double sum = 0.0;
+    for (auto &p : particles)
+      sum += p.weight * (p.values[i] - m) * (p.values[i] - m);
+    return sqrt(sum);
+  }
+
+  bool run()
+  {
+    previous.swap(particles);
+    kernel.clear();
+    if (generation > 0) {
+      std::vector<double> weights;
+      for (auto &p : previous)
+	weights.push_back(p.weight);
+      choices.build(weights.data(), weights.size());
+      // (Never quite 0, in case the particles have all come together)
+      for (size_t i = 0; i < priors.size(); ++i)
+	kernel.push_back(std::max(sqrt(2.0) * sd(previous, i),
+				  1e-9 * (priors[i].high - priors[i].low)));
+    }
+    particles.assign(num_particles, Particle());
+    // What happened in each slot, added up after the threads are done
+    std::vector<size_t> slot_attempts(num_particles, 0);
+    std::vector<size_t> slot_steps(num_particles, 0);
+    std::vector<size_t> slot_stopped(num_particles, 0);
+    std::vector<size_t> slot_full(num_particles, 0);
+    std::vector<char> filled(num_particles, 0);
+    std::atomic<unsigned> next_slot(0);
+    auto work = [&]() {
+      for (unsigned s = next_slot++; s < num_particles; s = next_slot++)
+	filled[s] = fill(s, particles[s], slot_attempts[s], slot_steps[s],
+			 slot_stopped[s], slot_full[s]);
+    };
+    const unsigned num = std::max(1u, std::min(num_threads, num_particles));
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t + 1 < num; ++t)
+      threads.push_back(std::thread(work));
+    work();
+    for (auto &t : threads)
+      t.join();
+
+    attempts = steps = stopped = 0;
+    bool ok = true;
+    for (unsigned s = 0; s < num_particles; ++s) {
+      attempts += slot_attempts[s];
+      steps += slot_steps[s];
+      stopped += slot_stopped[s];
+      full_steps = std::max(full_steps, slot_full[s]);
+      ok = ok && filled[s];
+    }
+    if (!ok) {
+      particles.swap(previous);
+      return false;
+    }
+    // Weight each particle by its prior density (the same for all, since
+    // they're uniform) over the density of proposing it
+    double sum = 0.0;
+    for (auto &p : particles) {
+      if (generation == 0) {
+	p.weight = 1.0;
+      } else {
+	double density = 0.0;
+	for (auto &q : previous) {
+	  double k = q.weight;
+	  for (size_t i = 0; i < priors.size(); ++i) {
+	    double z = (p.values[i] - q.values[i]) / kernel[i];
+	    k *= exp(-0.5 * z * z) / kernel[i];
+	  }
+	  density += k;
+	}
+	p.weight = density > 0.0 ? 1.0 / density : 0.0;
+      }
+      sum += p.weight;
+    }
+    for (auto &p : particles)
+      p.weight /= sum;
+    return true;
+  }
+
+  // Fill slot s, counting what it took. full is set to the number of steps
+  // in any simulation that wasn't stopped early.
+  bool fill(const unsigned s, Particle& particle, size_t& attempts,
+	    size_t& steps, size_t& stopped, size_t& full) const
+  {
+    std::seed_seq sequence{seed, generation, s};
+    Generator generator;
+    generator.seed(sequence);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    particle.values.resize(priors.size());
+    // Proposals outside the priors don't count as attempts, since they
+    // aren't simulated, but there's a limit to them too
+    for (size_t proposals = 0;
+	 attempts < max_attempts && proposals < 100 * max_attempts;
+	 ++proposals) {
+      if (generation == 0) {
+	for (size_t i = 0; i < priors.size(); ++i)
+	  particle.values[i] = priors[i].low
+	    + uniform(generator) * (priors[i].high - priors[i].low);
+      } else {
+	// Move a particle of the last generation, and try again if that
+	// takes it outside the priors
+	const Particle& from = previous[choices.sample(generator)];
+	bool inside = true;
+	for (size_t i = 0; i < priors.size(); ++i) {
+	  particle.values[i] = from.values[i] + kernel[i] * normal(generator);
+	  inside = inside && particle.values[i] >= priors[i].low
+	    && particle.values[i] <= priors[i].high;
+	}
+	if (!inside)
+	  continue;
+      }
+      ++attempts;
+      size_t n = 0;
+      particle.distance = distance(particle.values, generator(), tolerance,
+				   n);
+      steps += n;
+      if (std::isinf(particle.distance)) {
+	++stopped;
+	continue;
+      }
+      full = n;
+      if (particle.distance <= tolerance)
+	return true;
+    }
+    return false;
+  }
+};
+
+#endif
@@ -0,0 +1,385 @@
+// Instrumentation of the simulation's time steps.
+//
+// This is only compiled in if TUTSIM_INSTRUMENT is defined (make
+// instrumented does this). Otherwise the macros at the bottom expand to
+// nothing and cost nothing.
+//
+// In an instrumented build each Engine times the phases of each step
+// (shuffling the agents, working out the force of infection, the events,
+// migration between regions, testing campaigns, swapping counts with the
+// other shards if sharded, and reporting) and counts the agents visited,
+// random numbers drawn and infections, and the heap allocations (if the
+// program counts them in operator new, as tutsim.cc does). It can be switched
+// off at run time with the INSTRUMENT parameter. print() gives a breakdown of
+// where the time went, and if trace is set, a CSV row is written to it for
+// every step.
+//
+// On Linux the phases can also be measured with the hardware performance
+// counters (cycles, instructions, last level cache misses and branch misses)
+// using perf_event_open. This is what tells you whether a phase is held up by
+// memory or by branches, so use it when judging changes to the layout of
+// Agent. The counters only count the thread that calls step(), in user space,
+// and they may not be available at all (e.g. in some virtual machines, or if
+// /proc/sys/kernel/perf_event_paranoid is above 2), in which case print()
+// says so and only the timings are given.
+
+#ifndef TUTSIM_INSTRUMENT_HH
+#define TUTSIM_INSTRUMENT_HH
+
+#ifdef TUTSIM_INSTRUMENT
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring> // strerror
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum Phase {
+  PHASE_SHUFFLE,
+  PHASE_FORCE,
+  PHASE_EVENTS,
+  PHASE_MIGRATE,
+  PHASE_CAMPAIGN,
+  PHASE_EXCHANGE,
+  PHASE_REPORT,
+  NUM_PHASES
+};
+
+enum Counter {
+  AGENTS_VISITED,
+  RANDOM_DRAWS,
+  INFECTIONS,
+  HEAP_ALLOCATIONS,
+  NUM_COUNTERS
+};
+
+const char *const phase_names[NUM_PHASES] = {
+  "shuffle", "force", "events", "migrate", "campaign", "exchange", "report"
+};
+
+const char *const counter_names[NUM_COUNTERS] = {
+  "agents_visited", "random_draws", "infections", "heap_allocations"
+};
+
+// Number of calls to operator new so far. A program that replaces operator
+// new can add to this, so that we can check that the steps don't allocate.
+inline std::atomic<unsigned long long>& heap_allocations()
+{
+  static std::atomic<unsigned long long> count(0);
+  return count;
+}
+
+enum Event {
+  CYCLES,
+  INSTRUCTIONS,
+  LLC_MISSES,
+  BRANCH_MISSES,
+  NUM_EVENTS
+};
+
+const char *const event_names[NUM_EVENTS] = {
+  "cycles", "instructions", "llc_misses", "branch_misses"
+};
+
+// The hardware counters of the calling thread, opened as one group so that
+// they're all counting at the same time. Events that the processor doesn't
+// have are left out, and read() gives 0 for them.
+class PerfCounters {
+public:
+  int fds[NUM_EVENTS] = {-1, -1, -1, -1};
+  int order[NUM_EVENTS]; // The events in the order they were added
+  int num_open = 0;
+  std::string error; // Why opening failed, if it did
+
+  PerfCounters() {}
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+  ~PerfCounters() { close(); }
+
+  // Returns false if none of the events could be opened
+  bool open()
+  {
+#ifdef __linux__
+    if (num_open)
+      return true;
+    const unsigned long long configs[NUM_EVENTS] = {
+      PERF_COUNT_HW_CPU_CYCLES,
+      PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES,
+      PERF_COUNT_HW_BRANCH_MISSES
+    };
+    for (int e = 0; e < NUM_EVENTS; ++e) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = configs[e];
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      int leader = num_open ? fds[order[0]] : -1;
+      attr.disabled = leader == -1; // The group starts when the leader does
+      int fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+      if (fd == -1) {
+	if (error.empty())
+	  error = std::string(event_names[e]) + ": " + strerror(errno);
+	continue;
+      }
+      fds[e] = fd;
+      order[num_open++] = e;
+    }
+    if (num_open == 0)
+      return false;
+    ioctl(fds[order[0]], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[order[0]], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+#else
+    error = "only available on Linux";
+    return false;
+#endif
+  }
+
+  void close()
+  {
+#ifdef __linux__
+    for (auto &fd : fds) {
+      if (fd != -1)
+	::close(fd);
+      fd = -1;
+    }
+#endif
+    num_open = 0;
+  }
+
+  bool is_open() const { return num_open > 0; }
+
+  // The counts so far
+  void read(unsigned long long values[NUM_EVENTS]) const
+  {
+    for (int e = 0; e < NUM_EVENTS; ++e)
+      values[e] = 0;
+#ifdef __linux__
+    if (!num_open)
+      return;
+    // With PERF_FORMAT_GROUP the leader gives the number of events followed
+    // by their values
+    unsigned long long buffer[1 + NUM_EVENTS];
+    if (::read(fds[order[0]], buffer, sizeof(buffer)) < (ssize_t)
+	((1 + num_open) * sizeof(buffer[0])))
+      return;
+    for (int i = 0; i < num_open; ++i)
+      values[order[i]] = buffer[1 + i];
+#endif
+  }
+};
+
+class Instruments {
+public:
+  bool enabled = true;
+  std::ostream *trace = nullptr; // Per step CSV, if not nullptr
+  double seconds[NUM_PHASES] = {};
+  unsigned long long counts[NUM_COUNTERS] = {};
+  unsigned steps = 0;
+  // The current step's share of the above
+  double step_seconds[NUM_PHASES] = {};
+  unsigned long long step_counts[NUM_COUNTERS] = {};
+  unsigned long long step_heap_allocations = 0; // Count at start of the step
+  // Heap allocations in the steps after the first, which sizes the arenas.
+  // There shouldn't be any (make check-allocations checks this).
+  unsigned long long later_heap_allocations = 0;
+  unsigned first_allocating_step = 0; // The first of those steps, if any
+  // Hardware counters, if open_counters() worked
+  PerfCounters perf;
+  bool perf_wanted = false;
+  unsigned long long events[NUM_PHASES][NUM_EVENTS] = {};
+  unsigned long long step_events[NUM_PHASES][NUM_EVENTS] = {};
+
+  void open_counters()
+  {
+    perf_wanted = true;
+    perf.open();
+  }
+
+  void start_step()
+  {
+    for (auto &s : step_seconds)
+      s = 0.0;
+    for (auto &c : step_counts)
+      c = 0;
+    for (auto &p : step_events)
+      for (auto &e : p)
+	e = 0;
+    step_heap_allocations = heap_allocations();
+  }
+
+  void add_time(const Phase phase, const double s)
+  {
+    seconds[phase] += s;
+    step_seconds[phase] += s;
+  }
+
+  void add_events(const Phase phase, const unsigned long long start[],
+		  const unsigned long long end[])
+  {
+    for (int e = 0; e < NUM_EVENTS; ++e) {
+      events[phase][e] += end[e] - start[e];
+      step_events[phase][e] += end[e] - start[e];
+    }
+  }
+
+  void count(const Counter counter, const unsigned long long n)
+  {
+    counts[counter] += n;
+    step_counts[counter] += n;
+  }
+
+  void end_step(const double date)
+  {
+    unsigned long long allocations =
+      heap_allocations() - step_heap_allocations;
+    count(HEAP_ALLOCATIONS, allocations);
+    if (steps > 0 && allocations > 0) {
+      if (later_heap_allocations == 0)
+	first_allocating_step = steps;
+      later_heap_allocations += allocations;
+    }
+    if (trace) {
+      std::ostream& out = *trace;
+      if (steps == 0) {
+	out << "step,date";
+	for (auto name : phase_names)
+	  out << "," << name << "_seconds";
+	for (auto name : counter_names)
+	  out << "," << name;
+	if (perf.is_open())
+	  for (auto phase : phase_names)
+	    for (auto event : event_names)
+	      out << "," << phase << "_" << event;
+	out << "\n";
+      }
+      out << steps << "," << std::setprecision(10) << date;
+      for (auto s : step_seconds)
+	out << "," << s;
+      for (auto c : step_counts)
+	out << "," << c;
+      if (perf.is_open())
+	for (auto &p : step_events)
+	  for (auto e : p)
+	    out << "," << e;
+      out << "\n";
+    }
+    ++steps;
+  }
+
+  void print(std::ostream& out) const
+  {
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    double total = 0.0;
+    for (auto s : seconds)
+      total += s;
+    out << "Steps: " << steps << std::endl;
+    out << std::left << std::setw(10) << "Phase" << std::right
+	<< std::setw(12) << "Seconds" << std::setw(8) << "%"
+	<< std::setw(14) << "us per step" << std::endl;
+    out << std::fixed;
+    for (int p = 0; p < NUM_PHASES; ++p)
+      out << std::left << std::setw(10) << phase_names[p] << std::right
+	  << std::setprecision(6) << std::setw(12) << seconds[p]
+	  << std::setprecision(2) << std::setw(8)
+	  << (total > 0.0 ? 100.0 * seconds[p] / total : 0.0)
+	  << std::setw(14) << (steps ? 1e6 * seconds[p] / steps : 0.0)
+	  << std::endl;
+    out << std::left << std::setw(10) << "total" << std::right
+	<< std::setprecision(6) << std::setw(12) << total << std::endl;
+    if (perf.is_open()) {
+      // Instructions per cycle, and misses per thousand instructions
+      out << std::left << std::setw(10) << "Phase" << std::right;
+      for (auto name : event_names)
+	out << std::setw(16) << name;
+      out << std::setw(8) << "IPC" << std::setw(10) << "LLC MPKI"
+	  << std::setw(10) << "Br MPKI" << std::endl;
+      for (int p = 0; p < NUM_PHASES; ++p) {
+	const unsigned long long *e = events[p];
+	out << std::left << std::setw(10) << phase_names[p] << std::right;
+	for (int i = 0; i < NUM_EVENTS; ++i)
+	  out << std::setw(16) << e[i];
+	double kilo = e[INSTRUCTIONS] / 1000.0;
+	out << std::setprecision(2)
+	    << std::setw(8) << (e[CYCLES] ? (double) e[INSTRUCTIONS]
+				/ e[CYCLES] : 0.0)
+	    << std::setw(10) << (kilo > 0.0 ? e[LLC_MISSES] / kilo : 0.0)
+	    << std::setw(10) << (kilo > 0.0 ? e[BRANCH_MISSES] / kilo : 0.0)
+	    << std::endl;
+      }
+      if (!perf.error.empty())
+	out << "Some perf counters unavailable (" << perf.error << ")"
+	    << std::endl;
+    } else if (perf_wanted) {
+      out << "Perf counters unavailable (" << perf.error << ")" << std::endl;
+    }
+    out.flags(flags);
+    out.precision(precision);
+    for (int c = 0; c < NUM_COUNTERS; ++c)
+      out << counter_names[c] << ": " << counts[c] << std::endl;
+    if (counts[AGENTS_VISITED])
+      out << "ns per agent visited: "
+	  << 1e9 * total / counts[AGENTS_VISITED] << std::endl;
+  }
+};
+
+// Adds the time from its construction to its destruction to a phase
+class PhaseTimer {
+public:
+  PhaseTimer(Instruments& instruments, const Phase phase) :
+    instruments(instruments), phase(phase)
+  {
+    if (instruments.enabled) {
+      instruments.perf.read(start_events);
+      start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~PhaseTimer()
+  {
+    if (instruments.enabled) {
+      std::chrono::duration<double> elapsed =
+	std::chrono::steady_clock::now() - start;
+      instruments.add_time(phase, elapsed.count());
+      unsigned long long end_events[NUM_EVENTS];
+      instruments.perf.read(end_events);
+      instruments.add_events(phase, start_events, end_events);
+    }
+  }
+
+private:
+  Instruments& instruments;
+  Phase phase;
+  std::chrono::steady_clock::time_point start;
+  unsigned long long start_events[NUM_EVENTS];
+};
+
+// Time the rest of the enclosing block as the given phase
+#define INSTRUMENT_PHASE(instruments, phase) \
+  PhaseTimer phase_timer_##phase((instruments), (phase))
+// Run the statement only if instrumentation is compiled in and switched on
+#define INSTRUMENT(instruments, statement) \
+  do { if ((instruments).enabled) { statement; } } while (0)
+
+#else
+
+#define INSTRUMENT_PHASE(instruments, phase)
+#define INSTRUMENT(instruments, statement)
+
+#endif
+
+#endif
@@ -0,0 +1,334 @@
+// Where the agents live in memory.
+//
+// On a machine with several sockets each socket has its own memory (a NUMA
+// node). Reading another socket's memory is slower, and goes through that
+// socket's memory controller. Linux puts a page on the node of the thread
+// that first writes to it, so a population that one thread fills in all ends
+// up on one node, and threads on the other sockets all have to read across.
+// Placement says how to spread the agents out:
+//
+//   PLACE_DEFAULT: just use the heap, like any other vector.
+//   PLACE_INTERLEAVE: spread the pages round robin over all the nodes.
+//   PLACE_FIRST_TOUCH: split the agents into num_threads chunks, the same way
+//     summarize() does, and have thread t touch chunk t first, so that each
+//     chunk is on the node of the thread that works on it.
+//
+// If pin is set, thread t (and for the last chunk, the calling thread) is
+// kept on the t-th CPU we're allowed to use, so that it stays next to its
+// chunk. The calling thread gets its old affinity back afterwards. Otherwise
+// the kernel is free to move threads between sockets.
+//
+// With tens of millions of agents, every pass over them (the shuffle most of
+// all, since it jumps about at random) misses the TLB on nearly every agent
+// if the memory is in 4 KiB pages. huge_pages asks for 2 MiB pages instead:
+//
+//   HUGE_PAGES_NONE: ordinary pages.
+//   HUGE_PAGES_TRANSPARENT: align the memory to 2 MiB and madvise() it, so
+//     the kernel backs it with transparent huge pages if it can.
+//   HUGE_PAGES_EXPLICIT: map it with MAP_HUGETLB from the pages reserved in
+//     /proc/sys/vm/nr_hugepages. If there aren't enough, fall back to
+//     transparent huge pages.
+//
+// If the kernel won't give us huge pages, we still get ordinary ones. Huge
+// pages work with all the placement modes; interleaving is then done in
+// 2 MiB pieces.
+//
+// Placement only matters on Linux. Elsewhere everything is PLACE_DEFAULT and
+// HUGE_PAGES_NONE.
+
+#ifndef TUTSIM_PLACEMENT_HH
+#define TUTSIM_PLACEMENT_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint> // uintptr_t
+#include <fstream>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum PlacementMode {
+  PLACE_DEFAULT = 0,
+  PLACE_INTERLEAVE = 1,
+  PLACE_FIRST_TOUCH = 2
+};
+
+enum HugePages {
+  HUGE_PAGES_NONE = 0,
+  HUGE_PAGES_TRANSPARENT = 1,
+  HUGE_PAGES_EXPLICIT = 2
+};
+
+const size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+class Placement {
+public:
+  PlacementMode mode = PLACE_DEFAULT;
+  unsigned num_threads = 1;
+  bool pin = false;
+  HugePages huge_pages = HUGE_PAGES_NONE;
+
+  bool operator==(const Placement& other) const
+  {
+    return mode == other.mode && num_threads == other.num_threads
+      && pin == other.pin && huge_pages == other.huge_pages;
+  }
+
+  // True if the memory is mapped by place() rather than taken from the heap
+  bool mapped() const
+  {
+#ifdef __linux__
+    return mode != PLACE_DEFAULT || huge_pages != HUGE_PAGES_NONE;
+#else
+    return false;
+#endif
+  }
+
+  // The number of bytes place() maps for the given number of bytes
+  size_t length(const size_t bytes) const
+  {
+    if (huge_pages == HUGE_PAGES_NONE)
+      return bytes;
+    return (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+  }
+};
+
+// Keep the calling thread on the t-th of the CPUs the program started with
+// (wrapping round if there aren't that many). Returns false if it can't.
+inline bool pin_thread(const unsigned t)
+{
+#ifdef __linux__
+  // Once a thread is pinned its own affinity is just one CPU, so remember
+  // what we were allowed at the start
+  static const cpu_set_t allowed = [] {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    return set;
+  }();
+  const int count = CPU_COUNT(&allowed);
+  if (count == 0)
+    return false;
+  int wanted = t % count;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed) && wanted-- == 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      return sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+  }
+#endif
+  (void) t;
+  return false;
+}
+
+// Pins the calling thread like pin_thread() for as long as it's in scope,
+// then lets it go back to the CPUs it was allowed before. Threads that do
+// one chunk of work on the caller's behalf use this, so that a caller that
+// does the last chunk itself isn't left pinned to one CPU for good.
+class ThreadPin {
+public:
+  ThreadPin(const unsigned t, const bool pin = true) : pinned(false)
+  {
+#ifdef __linux__
+    if (pin) {
+      CPU_ZERO(&saved);
+      pinned = sched_getaffinity(0, sizeof(saved), &saved) == 0
+	&& pin_thread(t);
+    }
+#else
+    (void) t;
+    (void) pin;
+#endif
+  }
+
+  ThreadPin(const ThreadPin&) = delete;
+  ThreadPin& operator=(const ThreadPin&) = delete;
+
+  ~ThreadPin()
+  {
+#ifdef __linux__
+    if (pinned)
+      sched_setaffinity(0, sizeof(saved), &saved);
+#endif
+  }
+
+private:
+  bool pinned;
+#ifdef __linux__
+  cpu_set_t saved;
+#endif
+};
+
+#ifdef __linux__
+
+// Ask for the pages from p to p + bytes to be spread over all the online
+// nodes. Does nothing on a machine with one node.
+inline bool interleave(void *p, const size_t bytes)
+{
+  const size_t max_nodes = 1024;
+  unsigned long mask[max_nodes / (8 * sizeof(unsigned long))] = {};
+  const size_t bits = 8 * sizeof(unsigned long);
+  // This is a list of ranges like "0-1,3"
+  std::ifstream in("/sys/devices/system/node/online");
+  std::string range;
+  unsigned nodes = 0;
+  while (std::getline(in, range, ',')) {
+    size_t first = 0, last = 0;
+    size_t dash = range.find('-');
+    first = std::stoul(range.substr(0, dash));
+    last = dash == std::string::npos ? first
+      : std::stoul(range.substr(dash + 1));
+    for (size_t n = first; n <= last && n < max_nodes; ++n) {
+      mask[n / bits] |= 1UL << (n % bits);
+      ++nodes;
+    }
+  }
+  if (nodes <= 1)
+    return false;
+  return syscall(__NR_mbind, p, bytes, MPOL_INTERLEAVE, mask, max_nodes + 1,
+		 0) == 0;
+}
+
+// Write to one byte of each page, splitting the memory into chunks of whole
+// elements in the same way that summarize() splits the agents
+inline void first_touch(char *p, const size_t bytes, const size_t element,
+			const Placement& placement)
+{
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t count = bytes / element;
+  const unsigned num_threads =
+    std::max<size_t>(1, std::min<size_t>(placement.num_threads, count));
+  const size_t chunk = count / num_threads;
+  auto touch = [=](const unsigned t) {
+    ThreadPin pin(t, placement.pin);
+    size_t begin = t * chunk * element;
+    size_t end = t == num_threads - 1 ? bytes : (t + 1) * chunk * element;
+    for (size_t i = begin; i < end; i = (i / page + 1) * page)
+      static_cast<volatile char *>(p)[i] = 0;
+  };
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t + 1 < num_threads; ++t)
+    threads.push_back(std::thread(touch, t));
+  touch(num_threads - 1); // The last chunk in this thread
+  for (auto &t : threads)
+    t.join();
+}
+
+// length bytes of memory aligned to a huge page, which the kernel may back
+// with transparent huge pages. length must be a multiple of HUGE_PAGE.
+inline void *map_transparent(const size_t length)
+{
+  // Map an extra huge page so there's an aligned start inside, then give
+  // back the bits either side of it
+  char *p = static_cast<char *>(mmap(nullptr, length + HUGE_PAGE,
+				     PROT_READ | PROT_WRITE,
+				     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (p == MAP_FAILED)
+    return MAP_FAILED;
+  size_t head = (HUGE_PAGE - (uintptr_t) p % HUGE_PAGE) % HUGE_PAGE;
+  if (head)
+    munmap(p, head);
+  munmap(p + head + length, HUGE_PAGE - head);
+  p += head;
+#ifdef MADV_HUGEPAGE
+  madvise(p, length, MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+#endif
+
+// Memory for bytes worth of elements of the given size, placed as asked
+inline void *place(const size_t bytes, const size_t element,
+		   const Placement& placement)
+{
+#ifdef __linux__
+  if (placement.mapped() && bytes > 0) {
+    // mmap gives us pages that nobody has touched yet
+    const size_t length = placement.length(bytes);
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (placement.huge_pages == HUGE_PAGES_EXPLICIT)
+      p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED && placement.huge_pages != HUGE_PAGES_NONE)
+      p = map_transparent(length);
+    if (p == MAP_FAILED)
+      p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::bad_alloc();
+    if (placement.mode == PLACE_INTERLEAVE)
+      interleave(p, length);
+    else if (placement.mode == PLACE_FIRST_TOUCH)
+      first_touch(static_cast<char *>(p), bytes, element, placement);
+    return p;
+  }
+#endif
+  (void) element;
+  return ::operator new(bytes);
+}
+
+inline void unplace(void *p, const size_t bytes, const Placement& placement)
+{
+#ifdef __linux__
+  if (placement.mapped() && bytes > 0) {
+    munmap(p, placement.length(bytes));
+    return;
+  }
+#endif
+  (void) bytes;
+  ::operator delete(p);
+}
+
+// An allocator that places the vector's memory as asked. Moving or
+// assigning a vector brings its placement with it.
+template <class T>
+class PopulationAllocator {
+public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+  Placement placement;
+
+  PopulationAllocator() {}
+  PopulationAllocator(const Placement& placement) : placement(placement) {}
+  template <class U>
+  PopulationAllocator(const PopulationAllocator<U>& other) :
+    placement(other.placement) {}
+
+  T *allocate(const size_t n)
+  {
+    return static_cast<T *>(place(n * sizeof(T), sizeof(T), placement));
+  }
+
+  void deallocate(T *p, const size_t n)
+  {
+    unplace(p, n * sizeof(T), placement);
+  }
+
+  template <class U> bool operator==(const PopulationAllocator<U>& other) const
+  {
+    return placement == other.placement;
+  }
+  template <class U> bool operator!=(const PopulationAllocator<U>& other) const
+  {
+    return !(placement == other.placement);
+  }
+};
+
+#endif
@@ -0,0 +1,151 @@
+// Choosing a random subset of the agents.
+//
+// Something like "test 5% of the population this month" could be done by
+// drawing a random number for every agent, as the infection event does. But
+// then a campaign costs as much as a step, however few agents it reaches.
+// These take time in proportion to the number chosen instead:
+//
+//   Subset::choose(): exactly k of the indices 0 to n - 1, by Floyd's
+//     algorithm. It draws k random numbers and keeps track of what it's
+//     chosen in a bitmap, which is cleared again afterwards, so once the
+//     bitmap is big enough nothing is allocated.
+//   Subset::choose_from(): exactly k of a given list of indices, e.g. the
+//     agents that pass some test, the same way.
+//   bernoulli_skip(): each of the indices 0 to n - 1 independently with
+//     probability p. Rather than a random number per index, it draws the gaps
+//     between the chosen ones from a geometric distribution, so it draws
+//     about n * p numbers.
+//   reservoir(): k of the indices that pass a test, when it isn't known how
+//     many do without looking at them all (Li's Algorithm L). It has to look
+//     at every index, but only draws O(k log(n / k)) random numbers.
+//
+// The chosen indices come back sorted, so that the agents are visited in
+// memory order.
+
+#ifndef TUTSIM_SAMPLE_HH
+#define TUTSIM_SAMPLE_HH
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <vector>
+
+class Subset {
+public:
+  std::vector<size_t> chosen; // The result of the last choice, sorted
+
+  // Make room for choosing up to k of up to n, so that choosing doesn't
+  // allocate
+  void reserve(const size_t n, const size_t k)
+  {
+    if (taken.size() < n)
+      taken.resize(n);
+    chosen.reserve(k);
+  }
+
+  // Choose min(k, n) of 0 to n - 1, all subsets of that size being equally
+  // likely
+  template <class Generator>
+  const std::vector<size_t>& choose(const size_t n, size_t k,
+				    Generator& generator)
+  {
+    k = std::min(k, n);
+    chosen.clear();
+    if (taken.size() < n)
+      taken.resize(n);
+    // For each j from n - k to n - 1, take a random t from 0 to j, or j
+    // itself if t has already been taken
+    for (size_t j = n - k; j < n; ++j) {
+      std::uniform_int_distribution<size_t> dist(0, j);
+      size_t t = dist(generator);
+      if (taken[t])
+	t = j;
+      taken[t] = true;
+      chosen.push_back(t);
+    }
+    for (auto i : chosen)
+      taken[i] = false;
+    std::sort(chosen.begin(), chosen.end());
+    return chosen;
+  }
+
+  // Choose min(k, size) of the indices in from
+  template <class Generator>
+  const std::vector<size_t>& choose_from(const std::vector<size_t>& from,
+					 const size_t k, Generator& generator)
+  {
+    choose(from.size(), k, generator);
+    for (auto &i : chosen)
+      i = from[i];
+    std::sort(chosen.begin(), chosen.end());
+    return chosen;
+  }
+
+private:
+  std::vector<bool> taken; // All false between choices
+};
+
+// Call f(i) for each i from 0 to n - 1 with probability p, in order
+template <class Generator, class F>
+void bernoulli_skip(const size_t n, const double p, Generator& generator,
+		    F f)
+{
+  if (p <= 0.0)
+    return;
+  if (p >= 1.0) {
+    for (size_t i = 0; i < n; ++i)
+      f(i);
+    return;
+  }
+  // The number of indices skipped before the next one chosen
+  std::geometric_distribution<size_t> skip(p);
+  for (size_t i = skip(generator); i < n; i += 1 + skip(generator))
+    f(i);
+}
+
+// Choose min(k, m) of the m indices i from 0 to n - 1 for which keep(i) is
+// true, all subsets of that size being equally likely. They're put in chosen,
+// sorted.
+template <class Generator, class Keep>
+void reservoir(const size_t n, const size_t k, Keep keep,
+	       Generator& generator, std::vector<size_t>& chosen)
+{
+  chosen.clear();
+  if (k == 0)
+    return;
+  std::uniform_real_distribution<double> dist(0.0, 1.0);
+  std::uniform_int_distribution<size_t> slot(0, k - 1);
+  auto uniform = [&dist, &generator]() {
+    return 1.0 - dist(generator); // Never 0, so it has a log
+  };
+  size_t i = 0;
+  // Fill the reservoir with the first k
+  for (; i < n && chosen.size() < k; ++i)
+    if (keep(i))
+      chosen.push_back(i);
+  // Then each later one replaces a random one in the reservoir, with a
+  // probability that falls as we go. w tracks the largest of k uniform
+  // numbers, and the number to pass over before the next replacement is
+  // geometric given w.
+  double w = 1.0;
+  auto passes = [&w, &uniform, n, k]() -> size_t {
+    w *= exp(log(uniform()) / k);
+    double pass = floor(log(uniform()) / log1p(-w));
+    return std::min(pass, (double) n);
+  };
+  size_t pass = passes();
+  for (; i < n; ++i) {
+    if (!keep(i))
+      continue;
+    if (pass > 0) {
+      --pass;
+      continue;
+    }
+    chosen[slot(generator)] = i;
+    pass = passes();
+  }
+  std::sort(chosen.begin(), chosen.end());
+}
+
+#endif
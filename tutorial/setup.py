@@ -0,0 +1,13 @@
+# Builds the tutsimcc Python extension. Usually run via "make python".
+from setuptools import setup, Extension
+
+setup(name="tutsimcc",
+      version="0.1",
+      description="Python interface to the C++ simulation in tutsim.hh",
+      ext_modules=[Extension("tutsimcc", ["tutsimmodule.cc"],
+                             depends=["tutsim.hh", "alias.hh", "arena.hh",
+                                      "instrument.hh", "placement.hh",
+                                      "sample.hh", "shard.hh", "workers.hh"],
+                             extra_compile_args=["-std=c++11", "-O3",
+                                                 "-pthread"],
+                             extra_link_args=["-pthread"])])
@@ -0,0 +1,238 @@
+// Running one simulation as several processes.
+//
+// A population that's too big for one process can be split into shards,
+// each simulated by its own process on the same machine. The agents never
+// leave their shard. What the shards do need from each other is the mixing
+// table: the force of infection in every shard depends on how many agents,
+// and how many infected agents, there are in each stratum across all of
+// them. So after every step each shard writes its counts into its own slot
+// in a block of POSIX shared memory, waits at a barrier for the others, and
+// adds up all the slots. That's a few hundred numbers per step, however many
+// agents there are. Each slot also has room for one number of which the
+// largest over the shards is wanted rather than the total, like the bound
+// the adaptive step size needs (see Engine::exchange()).
+//
+// The barrier is lock free (atomic counters in the shared memory, with the
+// waiting processes spinning and yielding the CPU), so no process ever blocks
+// in the kernel holding something another needs. There are two sets of
+// slots, used on alternate steps, so a shard that's finished adding up can
+// write its next counts without waiting for the slow ones to finish reading.
+//
+// If a shard dies, the others notice while they're waiting at the barrier
+// and throw std::runtime_error rather than waiting forever.
+//
+// Only on Linux (or anything else with fork and shm_open).
+
+#ifndef TUTSIM_SHARD_HH
+#define TUTSIM_SHARD_HH
+
+#include <algorithm> // max_element
+#include <atomic>
+#include <cstdio> // fflush
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+class Shards {
+public:
+  unsigned num_shards = 1; // 1 means not sharded
+  unsigned shard = 0; // The shard this process runs
+  unsigned num_counts = 0; // Numbers each shard contributes per exchange
+  std::vector<unsigned> sums; // Totals over the shards from exchange()
+  double largest = 0.0; // Largest of the shards' highs from exchange()
+
+  Shards() {}
+  Shards(const Shards&) = delete;
+  Shards& operator=(const Shards&) = delete;
+  ~Shards() { close(); }
+
+  // Set up the shared memory for num_shards shards that each contribute
+  // num_counts numbers. Call before fork(). Returns false on failure.
+  bool open(const unsigned num_shards, const unsigned num_counts)
+  {
+    close();
+    // The highs go after the counts, lined up for doubles
+    size_t counts = sizeof(Header)
+      + 2 * (size_t) num_shards * num_counts * sizeof(unsigned);
+    counts = (counts + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+    length = counts + 2 * (size_t) num_shards * sizeof(double);
+    std::string name = "/tutsim-" + std::to_string(getpid()) + "-"
+      + std::to_string(next_name()++);
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1)
+      return false;
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, length) == 0)
+      p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // The mapping stays after the name and descriptor are gone, and the
+    // shards get it by forking, so tidy those up now
+    ::close(fd);
+    shm_unlink(name.c_str());
+    if (p == MAP_FAILED)
+      return false;
+    header = new (p) Header();
+    slots = reinterpret_cast<unsigned *>(header + 1);
+    highs = reinterpret_cast<double *>(static_cast<char *>(p) + counts);
+    this->num_shards = num_shards;
+    this->num_counts = num_counts;
+    shard = 0;
+    exchanges = 0;
+    parent = getpid();
+    sums.assign(num_counts, 0);
+    largest = 0.0;
+    return true;
+  }
+
+  // Start the other shards as copies of this process. Returns the shard this
+  // process is to run: 0 in the original process.
+  unsigned fork()
+  {
+    // Otherwise anything waiting to be printed would be printed by each shard
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(nullptr);
+    for (unsigned s = 1; s < num_shards; ++s) {
+      pid_t pid = ::fork();
+      if (pid == 0) {
+	shard = s;
+	children.clear();
+	return shard;
+      }
+      if (pid == -1) {
+	header->failed = 1;
+	throw std::runtime_error("Couldn't start shard");
+      }
+      children.push_back(pid);
+    }
+    return shard;
+  }
+
+  // Where this shard should put its counts for the next exchange()
+  unsigned *slot()
+  {
+    return slots + ((exchanges % 2) * num_shards + shard) * num_counts;
+  }
+
+  // And where it should put its number for the largest to be taken of
+  double& high()
+  {
+    return highs[(exchanges % 2) * num_shards + shard];
+  }
+
+  // Wait for every shard to fill in its slot, then add them all up into
+  // sums, and find the largest high. Every shard has to call this the same
+  // number of times.
+  const std::vector<unsigned>& exchange()
+  {
+    const unsigned *set = slots + (exchanges % 2) * num_shards * num_counts;
+    const double *set_highs = highs + (exchanges % 2) * num_shards;
+    barrier();
+    for (unsigned i = 0; i < num_counts; ++i)
+      sums[i] = 0;
+    for (unsigned s = 0; s < num_shards; ++s)
+      for (unsigned i = 0; i < num_counts; ++i)
+	sums[i] += set[s * num_counts + i];
+    largest = *std::max_element(set_highs, set_highs + num_shards);
+    ++exchanges;
+    return sums;
+  }
+
+  // In shard 0, wait for the other shards to finish. Returns false if any of
+  // them failed.
+  bool wait()
+  {
+    bool ok = true;
+    for (size_t c = 0; c < children.size(); ++c) {
+      int status = 0;
+      if (children[c] != 0)
+	waitpid(children[c], &status, 0);
+      else
+	status = statuses[c];
+      ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    children.clear();
+    statuses.clear();
+    return ok;
+  }
+
+  void close()
+  {
+    if (header)
+      munmap(header, length);
+    header = nullptr;
+    num_shards = 1;
+    shard = 0;
+  }
+
+private:
+  struct Header {
+    std::atomic<unsigned> arrived;
+    std::atomic<unsigned> generation;
+    std::atomic<unsigned> failed;
+    Header() : arrived(0), generation(0), failed(0) {}
+  };
+  static_assert(ATOMIC_INT_LOCK_FREE == 2,
+		"Shared memory needs lock free atomics");
+
+  Header *header = nullptr;
+  unsigned *slots = nullptr; // [2][num_shards][num_counts]
+  double *highs = nullptr; // [2][num_shards]
+  size_t length = 0;
+  unsigned exchanges = 0;
+  pid_t parent = 0;
+  std::vector<pid_t> children; // 0 once reaped, with the status in statuses
+  std::vector<int> statuses;
+
+  static unsigned& next_name()
+  {
+    static unsigned n = 0;
+    return n;
+  }
+
+  void barrier()
+  {
+    unsigned generation = header->generation.load(std::memory_order_acquire);
+    if (header->arrived.fetch_add(1, std::memory_order_acq_rel) + 1
+	== num_shards) {
+      // Last one here lets everyone go
+      header->arrived.store(0, std::memory_order_relaxed);
+      header->generation.fetch_add(1, std::memory_order_release);
+      return;
+    }
+    for (unsigned spins = 1;
+	 header->generation.load(std::memory_order_acquire) == generation;
+	 ++spins) {
+      if (spins % 1024 == 0 && !peers_alive()
+	  && header->generation.load(std::memory_order_acquire) == generation)
+	header->failed = 1;
+      if (header->failed)
+	throw std::runtime_error("A shard of the simulation failed");
+      sched_yield();
+    }
+  }
+
+  // Shard 0 checks on the others, and they check on shard 0
+  bool peers_alive()
+  {
+    if (shard != 0)
+      return getppid() == parent;
+    statuses.resize(children.size());
+    for (size_t c = 0; c < children.size(); ++c)
+      if (children[c] != 0 && waitpid(children[c], &statuses[c], WNOHANG)
+	  == children[c]) {
+	children[c] = 0;
+	return false;
+      }
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,341 @@
+// Checks that the faster ways of running the simulation give the same
+// results as the reference way, and times them.
+//
+// Usage: tutbench [REPLICATES=n] [NAME=VALUE ...] [output file ...]
+//
+// Each mode in the modes table below is run REPLICATES times (default 30)
+// with different seeds. The prevalence is recorded every quarter, and for
+// each quarter the replicates of each mode are compared with those of the
+// reference mode using the two sample Kolmogorov-Smirnov test. A mode passes
+// if none of its quarters differ at the 5% level, after a Bonferroni
+// correction for the number of quarters. The average run time of each mode
+// is printed too.
+//
+// Any output files given (like output_cc.txt) have their final prevalence
+// compared with the reference mode's replicates. A file passes if its
+// prevalence is within the range the reference replicates predict for one
+// more run: its z score against their mean and standard deviation (times
+// sqrt(1 + 1/REPLICATES)) is inside the two sided 5% level, after a
+// Bonferroni correction for the number of files compared. Files that can't
+// be compared are skipped and say why: those with no prevalence in them,
+// those whose prevalence was rounded to 0 (Python 2 integer division), and
+// those from a run with a different number of agents or end date.
+//
+// NAME=VALUE sets a parameter for all the modes. The exit status is 1 if any
+// mode or file fails.
+
+#include <chrono>
+#include <cstdlib> // strtod
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h> // _exit
+
+#include "tutsim.hh"
+
+struct Mode {
+  const char *name;
+  std::vector<std::pair<const char *, double> > parameters;
+};
+
+// Add new ways of running the simulation here. The first is the reference.
+const std::vector<Mode> modes = {
+  {"reference", {}},
+  {"adaptive", {{"ADAPTIVE_STEP", 1}}},
+  {"weekly", {{"TIME_STEP", 7.0 / YEAR}}},
+  {"neutral-risk-groups", {{"NUM_RISK_GROUPS", 2},
+			   {"RISK_ACTIVITY_RATIO", 1.0}}},
+  // The shards have to agree on adaptive steps, including the bound on
+  // spatial transmission, which is small enough here not to show
+  {"sharded", {{"NUM_SHARDS", 4}, {"ADAPTIVE_STEP", 1},
+	       {"SPATIAL_RADIUS", 0.02}, {"RATE_SPATIAL_TRANSMISSION", 0.001}}},
+  {"regions", {{"NUM_REGIONS", 4}, {"MIGRATION_RATE", 1.0}}},
+  // Without transmission in them, households only stop the shuffle
+  {"households", {{"HOUSEHOLD_SIZE", 4},
+		  {"RATE_HOUSEHOLD_TRANSMISSION", 0.0}}},
+  {"partner-choice", {{"PARTNER_CHOICE", 1}}}
+};
+
+struct Run {
+  std::vector<double> prevalence; // At each checkpoint
+  double seconds;
+};
+
+// Run the simulation once, recording the prevalence at each checkpoint date.
+// The prevalence is interpolated between the steps either side of a
+// checkpoint, so modes with different step sizes can be compared.
+Run run(const Mode& mode,
+	const std::vector<std::pair<std::string, double> >& common,
+	const unsigned seed,
+	const std::vector<double>& checkpoints)
+{
+  Run result;
+  Engine engine;
+  engine.reporter.out = nullptr;
+  for (auto &p : common)
+    set_parameter(engine.parameters, p.first, p.second);
+  for (auto &p : mode.parameters)
+    set_parameter(engine.parameters, p.first, p.second);
+  engine.parameters["SEED"] = seed;
+
+  auto start = std::chrono::steady_clock::now();
+  if (!engine.shard()) {
+    std::cerr << "Couldn't set up shared memory for the shards" << std::endl;
+    exit(1);
+  }
+  if (engine.shards.shard != 0) {
+    // The other shards just run, and shard 0 records the prevalence
+    engine.create();
+    engine.start();
+    engine.simulate();
+    _exit(0);
+  }
+  engine.create();
+  engine.start();
+  double last_date = engine.date();
+  double last_prevalence = engine.prevalence();
+  size_t next = 0;
+  bool more;
+  do {
+    more = engine.step();
+    double date = engine.date();
+    double prevalence = engine.prevalence();
+    while (next < checkpoints.size() && checkpoints[next] <= date + 1e-9) {
+      double w = (checkpoints[next] - last_date) / (date - last_date);
+      result.prevalence.push_back(last_prevalence
+				  + w * (prevalence - last_prevalence));
+      ++next;
+    }
+    last_date = date;
+    last_prevalence = prevalence;
+  } while (more);
+  if (engine.sharded() && !engine.shards.wait()) {
+    std::cerr << "A shard of the simulation failed" << std::endl;
+    exit(1);
+  }
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  result.seconds = elapsed.count();
+  return result;
+}
+
+// Two sample Kolmogorov-Smirnov statistic
+double ks_statistic(std::vector<double> x, std::vector<double> y)
+{
+  std::sort(x.begin(), x.end());
+  std::sort(y.begin(), y.end());
+  size_t i = 0, j = 0;
+  double d = 0.0;
+  while (i < x.size() && j < y.size()) {
+    double v = std::min(x[i], y[j]);
+    while (i < x.size() && x[i] <= v)
+      ++i;
+    while (j < y.size() && y[j] <= v)
+      ++j;
+    d = std::max(d, fabs((double) i / x.size() - (double) j / y.size()));
+  }
+  return d;
+}
+
+// Asymptotic p value of the two sample KS statistic d (Numerical Recipes)
+double ks_p_value(const double d, const size_t n, const size_t m)
+{
+  double en = sqrt((double) n * m / (n + m));
+  double lambda = (en + 0.12 + 0.11 / en) * d;
+  double sum = 0.0, sign = 1.0;
+  for (int j = 1; j <= 100; ++j) {
+    double term = sign * 2.0 * exp(-2.0 * j * j * lambda * lambda);
+    sum += term;
+    if (fabs(term) < 1e-10 * sum)
+      return std::min(1.0, std::max(0.0, sum));
+    sign = -sign;
+  }
+  return 1.0; // Didn't converge, which happens when lambda is tiny
+}
+
+// z such that a standard normal is further than z from 0 with probability
+// alpha
+double two_sided_z(const double alpha)
+{
+  double low = 0.0, high = 40.0;
+  for (int i = 0; i < 100; ++i) {
+    double z = 0.5 * (low + high);
+    if (erfc(z / sqrt(2.0)) > alpha)
+      low = z;
+    else
+      high = z;
+  }
+  return 0.5 * (low + high);
+}
+
+// The last report in an output file
+struct Outcome {
+  bool found = false;
+  double date = 0.0;
+  double infected = 0.0;
+  double prevalence = 0.0;
+};
+
+// Reports look like "2016.5 Num infected: 2711 Prevalence: 0.2711" from the
+// C++ and Python programs, and "[1] 2016.5 2711 0.2711" from R
+Outcome final_outcome(const char *filename)
+{
+  std::ifstream in(filename);
+  std::string line;
+  Outcome result;
+  while (std::getline(in, line)) {
+    size_t infected = line.find("Num infected:");
+    size_t prevalence = line.rfind("Prevalence:");
+    if (infected != std::string::npos && prevalence != std::string::npos) {
+      result.found = true;
+      result.date = strtod(line.c_str(), nullptr);
+      result.infected = strtod(line.c_str() + infected + 13, nullptr);
+      result.prevalence = strtod(line.c_str() + prevalence + 11, nullptr);
+    } else if (line.compare(0, 4, "[1] ") == 0) {
+      std::istringstream fields(line.substr(4));
+      Outcome outcome;
+      if (fields >> outcome.date >> outcome.infected >> outcome.prevalence) {
+	outcome.found = true;
+	result = outcome;
+      }
+    }
+  }
+  return result;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned replicates = 30;
+  std::vector<std::pair<std::string, double> > common;
+  std::vector<const char *> files;
+  Engine defaults;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t equals = arg.find('=');
+    if (equals == std::string::npos) {
+      files.push_back(argv[i]);
+      continue;
+    }
+    std::string name = arg.substr(0, equals);
+    double value = strtod(arg.c_str() + equals + 1, nullptr);
+    if (name == "REPLICATES") {
+      replicates = std::max(2.0, value);
+    } else if (set_parameter(defaults.parameters, name, value)) {
+      common.push_back(std::make_pair(name, value));
+    } else {
+      std::cerr << "Unknown parameter: " << name << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<double> checkpoints;
+  double start = defaults.parameters["START_DATE"];
+  for (double t = 0.25; t <= defaults.parameters["NUM_YEARS"] + 1e-9;
+       t += 0.25)
+    checkpoints.push_back(start + t);
+
+  // results[mode][checkpoint][replicate]
+  std::vector<std::vector<std::vector<double> > > results(modes.size());
+  std::vector<double> seconds(modes.size());
+  for (size_t m = 0; m < modes.size(); ++m) {
+    results[m].resize(checkpoints.size());
+    for (unsigned r = 0; r < replicates; ++r) {
+      // Each mode gets its own seeds so that the samples are independent
+      Run result = run(modes[m], common, 1000 * m + r + 1, checkpoints);
+      for (size_t c = 0; c < checkpoints.size(); ++c)
+	results[m][c].push_back(result.prevalence[c]);
+      seconds[m] += result.seconds;
+    }
+    seconds[m] /= replicates;
+  }
+
+  const double alpha = 0.05 / std::max<size_t>(1, checkpoints.size());
+  bool all_passed = true;
+  std::cout << std::left << std::setw(22) << "Mode"
+	    << std::setw(12) << "Prevalence" << std::setw(10) << "Max D"
+	    << std::setw(12) << "Min p" << std::setw(8) << "Result"
+	    << std::setw(12) << "ms per run" << "Speed up" << std::endl;
+  for (size_t m = 0; m < modes.size(); ++m) {
+    double max_d = 0.0, min_p = 1.0;
+    for (size_t c = 0; c < checkpoints.size(); ++c) {
+      double d = ks_statistic(results[m][c], results[0][c]);
+      max_d = std::max(max_d, d);
+      min_p = std::min(min_p, ks_p_value(d, replicates, replicates));
+    }
+    double mean = 0.0;
+    if (!checkpoints.empty())
+      for (auto p : results[m].back())
+	mean += p / replicates;
+    bool passed = m == 0 || min_p >= alpha;
+    all_passed = all_passed && passed;
+    std::cout << std::setw(22) << modes[m].name
+	      << std::setw(12) << mean << std::setw(10) << max_d
+	      << std::setw(12) << min_p
+	      << std::setw(8) << (m == 0 ? "-" : passed ? "pass" : "FAIL")
+	      << std::setw(12) << seconds[m] * 1000
+	      << seconds[0] / seconds[m] << std::endl;
+  }
+
+  // Is each output file's final prevalence one that the reference could
+  // have given? First find out which files can be compared.
+  const double num_agents = defaults.parameters["NUM_AGENTS"];
+  const double end = checkpoints.empty() ? start : checkpoints.back();
+  std::vector<Outcome> outcomes;
+  std::vector<std::string> skipped;
+  size_t compared = 0;
+  for (auto filename : files) {
+    Outcome outcome = final_outcome(filename);
+    std::ostringstream reason;
+    if (!outcome.found || checkpoints.empty()) {
+      reason << "no prevalence found";
+    } else if (outcome.prevalence <= 0.0) {
+      if (outcome.infected > 0.0)
+	reason << "prevalence rounded to 0 with " << outcome.infected
+	       << " infected";
+      else
+	reason << "nobody infected";
+    } else if (fabs(outcome.infected / outcome.prevalence - num_agents)
+	       > 0.01 * num_agents) {
+      // The prevalence is printed to four figures, hence the 1%
+      reason << "run with " << outcome.infected / outcome.prevalence
+	     << " agents, not " << num_agents;
+    } else if (fabs(outcome.date - end) > 0.01) {
+      reason << "ends at " << outcome.date << ", not " << end;
+    } else {
+      ++compared;
+    }
+    outcomes.push_back(outcome);
+    skipped.push_back(reason.str());
+  }
+
+  double mean = 0.0, variance = 0.0;
+  if (!checkpoints.empty()) {
+    const std::vector<double>& reference = results[0].back();
+    for (auto p : reference)
+      mean += p / replicates;
+    for (auto p : reference)
+      variance += (p - mean) * (p - mean) / (replicates - 1);
+  }
+  const double spread = sqrt(variance * (1.0 + 1.0 / replicates));
+  const double z_limit = two_sided_z(0.05 / std::max<size_t>(1, compared));
+  for (size_t f = 0; f < files.size(); ++f) {
+    std::cout << files[f] << ": ";
+    if (!skipped[f].empty()) {
+      std::cout << "skipped (" << skipped[f] << ")" << std::endl;
+      continue;
+    }
+    double z = spread > 0.0 ? (outcomes[f].prevalence - mean) / spread
+      : outcomes[f].prevalence == mean ? 0.0 : HUGE_VAL;
+    bool passed = fabs(z) <= z_limit;
+    all_passed = all_passed && passed;
+    std::cout << "final prevalence " << outcomes[f].prevalence << ", z = "
+	      << z << " (limit " << z_limit << ") "
+	      << (passed ? "pass" : "FAIL") << std::endl;
+  }
+  return all_passed ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+// Calibrates the simulation to observed prevalence (see calibrate.hh).
+//
+// Usage: tutcalib [PARTICLES=n] [GENERATIONS=n] [NAME=VALUE ...] [targets]
+//
+// The parameters in the priors table below are fitted, by ABC-SMC with
+// PARTICLES particles (default 100) for GENERATIONS generations after the
+// first (default 5). NAME=VALUE sets any other parameter for all the
+// simulations; NUM_THREADS is the number of particles simulated at once.
+//
+// The targets file has a date and a prevalence on each line, e.g.
+//   2015.5 0.16
+//   2016.0 0.21
+// Without one, the targets are the prevalence every quarter of a run with the
+// default parameters, so the fit should come back to them.
+//
+// For each generation the tolerance, the number of simulations and how many
+// were stopped early, the share of the steps that early stopping saved, and
+// the posterior mean and standard deviation of each parameter are printed.
+
+#include <chrono>
+#include <cstdlib> // strtod
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "calibrate.hh"
+
+// Add parameters to fit here, with the range of their uniform priors.
+// RATE_NEW_PARTNER is fitted rather than PROB_NEW_PARTNER, which is worked
+// out from it. Note that the force of infection depends on the product of
+// the two, so only the product can be pinned down by prevalence alone.
+const std::vector<Prior> priors = {
+  {"RATE_NEW_PARTNER", 1.0, 20.0},
+  {"FORCE_INFECTION", 0.02, 0.3}
+};
+
+// The prevalence every quarter of a run with the default parameters
+std::vector<Target>
+default_targets(const std::vector<std::pair<std::string, double> >& common)
+{
+  Engine engine;
+  engine.reporter.out = nullptr;
+  for (auto &p : common)
+    set_parameter(engine.parameters, p.first, p.second);
+  engine.create();
+  engine.start();
+  std::vector<Target> targets;
+  double next = engine.date() + 0.25;
+  while (engine.step())
+    if (engine.date() >= next - 1e-9) {
+      targets.push_back({engine.date(), engine.prevalence()});
+      next += 0.25;
+    }
+  return targets;
+}
+
+int main(int argc, char *argv[])
+{
+  Calibration calibration;
+  unsigned generations = 5;
+  std::vector<std::pair<std::string, double> > common;
+  const char *filename = nullptr;
+  Engine defaults;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t equals = arg.find('=');
+    if (equals == std::string::npos) {
+      filename = argv[i];
+      continue;
+    }
+    std::string name = arg.substr(0, equals);
+    double value = strtod(arg.c_str() + equals + 1, nullptr);
+    if (name == "PARTICLES") {
+      calibration.num_particles = std::max(2.0, value);
+    } else if (name == "GENERATIONS") {
+      generations = std::max(0.0, value);
+    } else if (set_parameter(defaults.parameters, name, value)) {
+      common.push_back(std::make_pair(name, value));
+    } else {
+      std::cerr << "Unknown parameter: " << name << std::endl;
+      return 1;
+    }
+  }
+
+  calibration.priors = priors;
+  calibration.parameters = common;
+  calibration.num_threads = std::max(1.0, defaults.parameters["NUM_THREADS"]);
+  if (filename) {
+    std::ifstream in(filename);
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      Target target;
+      if (fields >> target.date >> target.prevalence)
+	calibration.targets.push_back(target);
+    }
+    if (calibration.targets.empty()) {
+      std::cerr << "No targets in " << filename << std::endl;
+      return 1;
+    }
+  } else {
+    calibration.targets = default_targets(common);
+    std::cout << "Fitting to a run with the default parameters:";
+    for (auto &p : priors)
+      for (auto &d : defaults.parameters)
+	if (p.name == d.first)
+	  std::cout << " " << p.name << "=" << d.second;
+    std::cout << std::endl;
+  }
+
+  std::cout << std::left << std::setw(5) << "Gen" << std::setw(12)
+	    << "Tolerance" << std::setw(10) << "Runs" << std::setw(10)
+	    << "Stopped" << std::setw(12) << "Steps saved" << std::setw(10)
+	    << "Seconds";
+  for (auto &p : priors)
+    std::cout << std::setw(24) << p.name;
+  std::cout << std::endl;
+  for (unsigned g = 0; g <= generations; ++g) {
+    auto start = std::chrono::steady_clock::now();
+    if (!(g == 0 ? calibration.start() : calibration.next())) {
+      std::cout << "Couldn't fill generation " << g << " in "
+		<< calibration.max_attempts << " runs per particle"
+		<< std::endl;
+      return 1;
+    }
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    // What the runs would have taken without stopping any early
+    double saved = 1.0 - (double) calibration.steps
+      / (calibration.attempts * calibration.full_steps);
+    std::ostringstream percent;
+    percent << std::setprecision(3) << 100.0 * saved << "%";
+    std::cout << std::setw(5) << g << std::setw(12) << calibration.tolerance
+	      << std::setw(10) << calibration.attempts << std::setw(10)
+	      << calibration.stopped << std::setw(12) << percent.str()
+	      << std::setw(10) << elapsed.count();
+    for (size_t i = 0; i < priors.size(); ++i) {
+      std::ostringstream estimate;
+      estimate << calibration.mean(i) << " +/- " << calibration.sd(i);
+      std::cout << std::setw(24) << estimate.str();
+    }
+    std::cout << std::endl;
+  }
+}
@@ -0,0 +1,2423 @@
+// The simulation, as a library. Everything is in this header so that you can
+// just #include it in your own programs. See the Engine class at the bottom
+// for how to drive a simulation, and tutsim.cc for a command line program
+// that uses it.
+
+#ifndef TUTSIM_HH
+#define TUTSIM_HH
+
+#include <algorithm> // Some STL algorithms we will use
+#include <cmath> // exp, log, pow
+#include <cstring> // strcmp
+#include <iostream> // Input output
+#include <map> // Ordered hash table, used to cache step probabilities
+#include <random> // Random number generators
+#include <stdexcept> // For complaining about names that aren't there
+#include <string> // For looking up parameters by name
+#include <thread> // For calculating statistics in parallel
+#include <unordered_map> // Hash table used to hold parameters
+#include <vector> // Most important C++ STL data structure
+
+#include "alias.hh" // Weighted random choices
+#include "arena.hh" // Scratch memory for each step
+#include "instrument.hh" // Timers and counters, if TUTSIM_INSTRUMENT is set
+#include "placement.hh" // Where in memory the agents go
+#include "sample.hh" // Choosing random subsets of the agents
+#include "shard.hh" // Splitting a simulation over several processes
+#include "workers.hh" // Threads that last the whole simulation
+
+// We use a Mersenee Twister random number generator. It's high quality for
+// simulations. It would be inefficient and cumbersome to reseed locally
+// declared generators, so each Engine has one, and passes it to the functions
+// that need random numbers. Giving each Engine its own, rather than having one
+// global generator, means we can run several simulations at the same time.
+//
+// Generator is a Mersenne Twister that can also give antithetic numbers (see
+// Streams): if it's set to, each number x it gives is replaced with
+// max() - x, so any uniform number u made from them comes out as (very
+// nearly) 1 - u instead. Since max() is all ones, that's just flipping the
+// bits, which costs next to nothing when they're not flipped. In an
+// instrumented build (see instrument.hh) it also counts the numbers it gives.
+
+class Generator : public std::mt19937 {
+public:
+#ifdef TUTSIM_INSTRUMENT
+  unsigned long long draws = 0;
+#endif
+
+  result_type operator()()
+  {
+#ifdef TUTSIM_INSTRUMENT
+    ++draws;
+#endif
+    return std::mt19937::operator()() ^ flip;
+  }
+
+  bool antithetic() const
+  {
+    return flip != 0;
+  }
+
+  void set_antithetic(const bool antithetic)
+  {
+    flip = antithetic ? max() : 0;
+  }
+
+private:
+  result_type flip = 0;
+};
+
+const double YEAR = 365;
+
+enum Sex {
+  MALE = 0,
+  FEMALE = 1
+};
+
+class Agent {
+  // All the books will tell you it's bad to make the class variables public
+  // but for our purposes I reckon it's fine. Keeps things simpler.
+public:
+  Sex sex;
+  // Whether a testing campaign has found the agent to be HIV+ (see
+  // Campaign). It's next to sex because it fits in the gap before age.
+  bool diagnosed;
+  double age;
+  /* This is the way I like to model HIV status:
+
+     0=HIV-
+     1=HIV+ primary infection
+     2=HIV+ CDC stage 1
+     ...
+     5=HIV+ CDC stage 4
+   */
+  unsigned hiv;
+  // Risk group: 0 is the lowest risk. Set by assign_risk_groups().
+  unsigned risk;
+  // The region the agent lives in (see Regions). 0 if there's only one.
+  unsigned region;
+  // Where the agent lives, if there's space (see Space). Otherwise 0.
+  float x, y;
+  // Index of the agent's cell in the mixing table (sex x age band x risk
+  // group). It's cached here so the event loop doesn't need to recompute it.
+  // The Mixing class below keeps it up to date.
+  unsigned stratum;
+  // The agent's age when it entered its current HIV stage
+  double stage_age;
+
+  // This method sets the values to random numbers, but you might need
+  // to replace it with something more complex, or even use a function
+  // declared outside the class if you need to know the status of other agents
+  void init(Generator& generator)
+  {
+    // Set the sex randomly to male or female;
+    {
+      std::bernoulli_distribution dist(0.5);
+      // This would also work fine and is a more common pattern:
+      // std::uniform_int_distribution dist(0, 1);
+      sex = dist(generator) == 0 ? MALE : FEMALE;
+    }
+    // Set the age randomly to a value between 15.0 and 20.0
+    {
+      std::uniform_real_distribution<double> dist(15.0, 20.0);
+      age = dist(generator);
+    }
+    // Set the HIV status. In practice something more sophisticated than this
+    // might be needed.
+    {
+      std::geometric_distribution<int> dist (0.9);
+      // This says if it's bigger than 5 make it 5, else i.
+      hiv = std::min(dist(generator), 5);
+    }
+    risk = 0;
+    diagnosed = false;
+    region = 0;
+    x = y = 0.0f;
+    stratum = 0;
+    stage_age = age;
+  }
+};
+
+// The agents are kept in a vector. Its allocator decides where in memory they
+// go (see placement.hh); by default they're just on the heap.
+typedef std::vector<Agent, PopulationAllocator<Agent> > Population;
+
+// You can also define the init function outside the class like this
+inline void init_agent(Agent &a, Generator& generator)
+{
+  // You can do this
+  a.init(generator);
+  // Or you could do something like this:
+  // {
+  //   std::bernoulli_distribution dist(0.5);
+  //   a.sex = dist(generator);
+  // }
+  // etc ...
+}
+
+
+inline void
+initialize_agents(Population& agents, Generator& generator)
+// Note the parameter declaration:
+// Population& agents
+// This would be a mistake:
+// Population agents
+// It is inefficient because it tells the compiler to
+// make a copy of all the vector, which means making a copy of all the agents.
+// And because you're modifying copies, the effect of the function would be
+// to leave the vector you're passing unchanged, which is not what you want.
+{
+  // There are a few ways to loop through the agents. Which one you prefer
+  // is often a matter of taste.
+
+  // I think this is the most intuitive
+  for (size_t i = 0; i < agents.size(); ++i)
+    agents[i].init(generator);
+
+  // This is the iconic c++ way
+  for (auto it = agents.begin(); it < agents.end(); ++it)
+    it->init(generator);
+
+  // This is the way since c++11
+  for (auto &it : agents)
+    it.init(generator);
+
+  // Using the STL. Note this way we have to call init_agents, the function
+  // outside the class, and because it needs the generator too we wrap it in
+  // a lambda
+  for_each(agents.begin(), agents.end(),
+	   [&generator](Agent& a) { init_agent(a, generator); });
+}
+
+// Put agents into risk groups. With one risk group (the default) this does
+// nothing, and in particular it doesn't consume any random numbers, so the
+// output is the same as it was before risk groups were added.
+inline void assign_risk_groups(
+    Population& agents, std::unordered_map<const char *, double>& parameters,
+    Generator& generator)
+{
+  unsigned num_groups = parameters["NUM_RISK_GROUPS"];
+  if (num_groups < 2)
+    return;
+  std::uniform_int_distribution<unsigned> dist(0, num_groups - 1);
+  for (auto &a : agents)
+    a.risk = dist(generator);
+}
+
+// Structured mixing
+
+// Instead of one prevalence for the whole population, we split the agents
+// into strata by sex, age band and risk group, and keep a table of how many
+// agents, and how many infected agents, are in each stratum. The table is
+// updated as agents get infected or move into a new age band, so we never have
+// to scan the agents to find the prevalence.
+//
+// Once per time step we calculate the force of infection for each stratum from
+// the mixing matrix, which says what fraction of the partnerships of stratum s
+// are with stratum t. The infection event then only has to look up its
+// stratum's risk.
+//
+// The force of infection is a rate: an agent takes new partners at the annual
+// rate RATE_NEW_PARTNER (times its risk group's activity), and each of them
+// infects it with probability FORCE_INFECTION times the prevalence among its
+// partners. So infections happen at the annual rate (the hazard)
+//   RATE_NEW_PARTNER * activity * FORCE_INFECTION * prevalence
+// and the risk in a step of dt years is 1 - exp(-hazard * dt). Converting the
+// whole hazard, rather than just the rate of new partners, is what makes the
+// risk over a week the same whether it's taken in one step or seven.
+//
+// The mixing matrix is built from the "preferred mixing" model: a fraction,
+// ASSORTATIVITY, of each stratum's partnerships are reserved for partners in
+// the same stratum, and the rest are spread over all the strata in proportion
+// to their share of the population's partnerships. Sexually active risk groups
+// have more partners. With ASSORTATIVITY = 0 and one risk group, every row of
+// the matrix works out to the population's prevalence, i.e. everyone is still
+// 100% bisexual and well mixed, which is the original model.
+//
+// With AGE_PREFERENCE > 0 the rest aren't spread in proportion to share
+// alone: a partner k age bands away is weighted by exp(-k * AGE_BAND_WIDTH /
+// AGE_PREFERENCE), so most partners are within about AGE_PREFERENCE years.
+//
+// If there are several regions, each has its own set of strata, and
+// partnerships are only made within a region. So each region has its own
+// force of infection, worked out from its own prevalence.
+
+class Mixing {
+public:
+  unsigned num_regions;
+  unsigned num_age_bands;
+  unsigned num_risk_groups;
+  double min_age;  // Lower bound of the first age band
+  double band_width; // Width of each age band in years
+  double assortativity;
+  double age_preference;
+  std::vector<double> activity; // Relative partner change rate per risk group
+  // Weight of stratum t as a partner for stratum s, at [s * n + t] for the n
+  // strata of a region. Empty if there's no age preference.
+  std::vector<double> preferences;
+  std::vector<unsigned> total; // Number of agents in each stratum
+  std::vector<unsigned> infected; // Number of HIV+ agents in each stratum
+  std::vector<double> hazard; // Annual rate of infection in each stratum
+  std::vector<double> force; // Per step risk of infection in each stratum
+
+  unsigned num_strata() const
+  {
+    return num_regions * strata_per_region();
+  }
+
+  unsigned strata_per_region() const
+  {
+    return 2 * num_age_bands * num_risk_groups;
+  }
+
+  size_t population() const
+  {
+    size_t result = 0;
+    for (auto t : total)
+      result += t;
+    return result;
+  }
+
+  unsigned num_infected() const
+  {
+    unsigned result = 0;
+    for (auto i : infected)
+      result += i;
+    return result;
+  }
+
+  unsigned num_males() const
+  {
+    unsigned result = 0;
+    for (unsigned s = 0; s < num_strata(); ++s)
+      if (s / (num_age_bands * num_risk_groups) % 2 == MALE)
+	result += total[s];
+    return result;
+  }
+
+  unsigned age_band(double age) const
+  {
+    if (age < min_age)
+      return 0;
+    unsigned band = (age - min_age) / band_width;
+    return std::min(band, num_age_bands - 1);
+  }
+
+  // The strata are laid out as [region][sex][age band][risk group]
+  unsigned stratum(const Agent& a) const
+  {
+    return ((a.region * 2 + a.sex) * num_age_bands + age_band(a.age))
+      * num_risk_groups + a.risk;
+  }
+
+  // Set up the table from scratch. This is the only time we scan the agents.
+  void init(Population& agents,
+	    std::unordered_map<const char *, double>& parameters)
+  {
+    num_regions = std::max(1.0, parameters["NUM_REGIONS"]);
+    num_age_bands = std::max(1.0, parameters["NUM_AGE_BANDS"]);
+    num_risk_groups = std::max(1.0, parameters["NUM_RISK_GROUPS"]);
+    min_age = parameters["MIN_AGE_BAND"];
+    band_width = parameters["AGE_BAND_WIDTH"];
+    assortativity = parameters["ASSORTATIVITY"];
+    age_preference = parameters["AGE_PREFERENCE"];
+
+    // Each risk group has RISK_ACTIVITY_RATIO times as many partners as the
+    // group below it. We scale so that the average agent's rate is unchanged.
+    activity.assign(num_risk_groups, 1.0);
+    double ratio = parameters["RISK_ACTIVITY_RATIO"];
+    if (num_risk_groups > 1 && ratio > 0.0) {
+      double sum = 0.0;
+      for (unsigned r = 0; r < num_risk_groups; ++r) {
+	activity[r] = pow(ratio, r);
+	sum += activity[r];
+      }
+      for (auto &c : activity)
+	c *= num_risk_groups / sum;
+    }
+
+    const unsigned n = strata_per_region();
+    preferences.clear();
+    if (age_preference > 0.0) {
+      preferences.resize(n * n);
+      for (unsigned s = 0; s < n; ++s)
+	for (unsigned t = 0; t < n; ++t) {
+	  int apart = (int) (s / num_risk_groups % num_age_bands)
+	    - (int) (t / num_risk_groups % num_age_bands);
+	  preferences[s * n + t] =
+	    exp(-std::abs(apart) * band_width / age_preference);
+	}
+    }
+
+    total.assign(num_strata(), 0);
+    infected.assign(num_strata(), 0);
+    hazard.assign(num_strata(), 0.0);
+    force.assign(num_strata(), 0.0);
+    for (auto &a : agents) {
+      a.stratum = stratum(a);
+      ++total[a.stratum];
+      if (a.hiv > 0)
+	++infected[a.stratum];
+    }
+  }
+
+  // Calculate the risk of infection in a step of time_step years for each
+  // stratum. Call this once per time step, before the events. The working is
+  // done in scratch.
+  void update_force(const double rate_new_partner,
+		    const double force_infection, const double time_step,
+		    Arena& scratch)
+  {
+    update_hazard(rate_new_partner, force_infection, scratch);
+    for (unsigned s = 0; s < num_strata(); ++s)
+      force[s] = 1.0 - exp(-hazard[s] * time_step);
+  }
+
+  // Calculate just the annual rate of infection for each stratum
+  void update_hazard(const double rate_new_partner,
+		     const double force_infection, Arena& scratch)
+  {
+    const unsigned n = strata_per_region();
+    // Share of all partnerships that involve stratum t, and the share of those
+    // that are with an infected partner
+    double *share = scratch.allocate<double>(n);
+    double *prevalence = scratch.allocate<double>(n);
+    for (unsigned r = 0; r < num_regions; ++r) {
+      // This region's strata
+      const unsigned *total = &this->total[r * n];
+      const unsigned *infected = &this->infected[r * n];
+      double *hazard = &this->hazard[r * n];
+      double sum = 0.0;
+      for (unsigned t = 0; t < n; ++t) {
+	share[t] = activity[t % num_risk_groups] * total[t];
+	sum += share[t];
+	prevalence[t] = total[t] ? (double) infected[t] / total[t] : 0.0;
+      }
+      double mixed_prevalence = 0.0;
+      if (sum > 0.0)
+	for (unsigned t = 0; t < n; ++t)
+	  mixed_prevalence += share[t] / sum * prevalence[t];
+      for (unsigned s = 0; s < n; ++s) {
+	double p = assortativity * prevalence[s] + (1.0 - assortativity)
+	  * (preferences.empty() ? mixed_prevalence
+	     : preferred(s, share, prevalence));
+	hazard[s] = rate_new_partner * activity[s % num_risk_groups]
+	  * force_infection * p;
+      }
+    }
+  }
+
+  // The prevalence among the partners of stratum s (of a region) that aren't
+  // reserved for its own stratum, with the age preference, given each
+  // stratum's share of partnerships and prevalence
+  double preferred(const unsigned s, const double *share,
+		   const double *prevalence) const
+  {
+    const unsigned n = strata_per_region();
+    const double *weight = &preferences[s * n];
+    double sum = 0.0, infected = 0.0;
+    for (unsigned t = 0; t < n; ++t) {
+      sum += weight[t] * share[t];
+      infected += weight[t] * share[t] * prevalence[t];
+    }
+    return sum > 0.0 ? infected / sum : 0.0;
+  }
+
+  void infect(Agent& a)
+  {
+    a.hiv = 1;
+    a.stage_age = a.age;
+    ++infected[a.stratum];
+  }
+
+  // Move an agent to another region
+  void move(Agent& a, const unsigned region)
+  {
+    a.region = region;
+    update_stratum(a);
+  }
+
+  // Move an agent to its new stratum if it has changed age band
+  void update_stratum(Agent& a)
+  {
+    unsigned s = stratum(a);
+    if (s != a.stratum) {
+      --total[a.stratum];
+      ++total[s];
+      if (a.hiv > 0) {
+	--infected[a.stratum];
+	++infected[s];
+      }
+      a.stratum = s;
+    }
+  }
+};
+
+// Let's have a couple of events: become infected, and get older
+
+// Expose agents to HIV and infect them. This would be replaced
+// with a partner matching algorithm in a more sophisticated simulation.
+// The risk of infection depends on the agent's stratum (see Mixing above).
+
+inline void infection_event(Agent& a, Mixing& mixing, Generator& generator)
+{
+  if (a.hiv == 0) {
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    if (dist(generator) < mixing.force[a.stratum])
+      mixing.infect(a);
+  }
+}
+
+// Every agent has to age on each iteration of the simulation
+inline void age_event(Agent& a, const double time_elapsed, Mixing& mixing)
+{
+  a.age += time_elapsed;
+  mixing.update_stratum(a);
+}
+
+// Common random numbers
+
+// To compare two scenarios (say two values of FORCE_INFECTION) we run each
+// several times and compare the results. Each run's randomness is noise in
+// the comparison, and it takes a lot of runs to see a small difference
+// through it. If both scenarios use the same random numbers for the same
+// things, most of the noise is the same in both, and cancels out when they're
+// compared. But with one generator for everything that doesn't happen: the
+// infection event only draws a number for uninfected agents, so as soon as
+// one agent's status differs between the scenarios, every later draw goes to
+// a different agent.
+//
+// With COMMON_RANDOM_NUMBERS = 1 each random process has its own stream, so
+// they can't put each other out of step: the main generator creates the
+// agents and shuffles them, and the infection events, migration and testing
+// campaigns each have a generator seeded from SEED and a stream number. And
+// the infection event draws a number for every agent, infected or not. Then,
+// in two scenarios with the same SEED and population, the shuffles are the
+// same, the agent at each place in the agents vector is the same agent, and it
+// gets the same random number for its infection event on every step. (The
+// household, spatial and partner choice events still only draw numbers when
+// they need them, so they're only in step until the scenarios differ.)
+//
+// ANTITHETIC = 1 also uses common random numbers, but every generator gives
+// antithetic numbers (see Generator), so 1 - u is used wherever u would have
+// been, from creating the agents on. A run with ANTITHETIC = 0 and one with
+// ANTITHETIC = 1, with the same SEED, make an antithetic pair: where one is
+// unlucky the other tends to be lucky, so the average of the pair varies less
+// than the average of two independent runs. How much less depends on the
+// model: an event with probability p in a step can't happen to the same agent
+// in both runs, but when p is small that's a weak link, so with daily steps
+// the gain is modest.
+//
+// Both are off by default, and then there's just the one generator.
+
+class Streams {
+public:
+  bool common = false;
+  bool antithetic = false;
+  Generator events;
+  Generator migration;
+  Generator campaign;
+
+  // Seed the streams from SEED, and shard if sharded. ANTITHETIC is read
+  // here, since it applies to creating the agents too.
+  void seed(std::unordered_map<const char *, double>& parameters,
+	    const unsigned shard)
+  {
+    antithetic = parameters["ANTITHETIC"] != 0.0;
+    const unsigned seed = parameters["SEED"];
+    Generator *streams[] = {&events, &migration, &campaign};
+    for (unsigned s = 0; s < 3; ++s) {
+      std::seed_seq sequence{seed, shard, s + 1};
+      streams[s]->seed(sequence);
+      streams[s]->set_antithetic(antithetic);
+    }
+  }
+
+  void init(std::unordered_map<const char *, double>& parameters)
+  {
+    common = antithetic || parameters["COMMON_RANDOM_NUMBERS"] != 0.0;
+  }
+
+  // The generator to use for a process: its own stream if there are common
+  // random numbers, or else the main one
+  Generator& choose(Generator& stream, Generator& main)
+  {
+    return common ? stream : main;
+  }
+};
+
+// The infection event for common random numbers, which draws a number
+// whether or not the agent is infected
+inline void common_infection_event(Agent& a, Mixing& mixing,
+				   Generator& generator)
+{
+  std::uniform_real_distribution<double> dist(0.0, 1.0);
+  double u = dist(generator);
+  if (a.hiv == 0 && u < mixing.force[a.stratum])
+    mixing.infect(a);
+}
+
+// Partner choice
+
+// With PARTNER_CHOICE = 1 the infection event is done the long way round.
+// Instead of using the stratum's force of infection, an uninfected agent
+// may take a new partner, chooses the partner's stratum from its row of the
+// mixing matrix, and is infected with probability FORCE_INFECTION times that
+// stratum's prevalence. Each partnership is now a separate choice, which is
+// where a partner matching algorithm would fit in.
+//
+// For this to come out the same as the force of infection on average, the
+// probability of a partner in a step can't just be 1 - exp(-rate * dt), with
+// rate RATE_NEW_PARTNER times the risk group's activity. If q is the average
+// risk of infection from one partner, the risk in the step has to be
+// 1 - exp(-rate * q * dt) (see Mixing), so the probability of a partner is
+// that divided by q. To first order both are rate * dt. (If rate * dt is so
+// big that this comes to more than 1, it's 1, and the risk falls short.)
+//
+// Each stratum's row of the mixing matrix is an alias table (see alias.hh),
+// so a choice takes the same time however many strata there are. The rows
+// depend on the counts in the mixing table, so update() builds them again
+// each step, but only the rows whose weights have changed.
+
+class Partners {
+public:
+  std::vector<AliasTable> rows; // For each stratum, over its region's strata
+  std::vector<double> risk; // Risk of infection from a partner in a stratum
+  std::vector<double> prob_partner; // Probability of a partner, by stratum
+
+  void init(std::unordered_map<const char *, double>& parameters,
+	    const Mixing& mixing)
+  {
+    rows.clear();
+    if (parameters["PARTNER_CHOICE"] != 0.0)
+      rows.resize(mixing.num_strata());
+  }
+
+  bool enabled() const
+  {
+    return !rows.empty();
+  }
+
+  // Work out the rows from table (for all the shards, if sharded). Call
+  // once per step, before the events.
+  void update(const Mixing& table, const double rate_new_partner,
+	      const double force_infection, const double time_step)
+  {
+    const unsigned n = table.strata_per_region();
+    const double a = table.assortativity;
+    share.resize(n);
+    weights.resize(n);
+    risk.resize(table.num_strata());
+    prob_partner.resize(table.num_strata());
+    for (unsigned r = 0; r < table.num_regions; ++r) {
+      const unsigned *total = &table.total[r * n];
+      double sum = 0.0;
+      for (unsigned t = 0; t < n; ++t) {
+	share[t] = table.activity[t % table.num_risk_groups] * total[t];
+	sum += share[t];
+	risk[r * n + t] = total[t] ? force_infection
+	  * table.infected[r * n + t] / total[t] : 0.0;
+      }
+      for (unsigned s = 0; s < n; ++s) {
+	// As in Mixing::update_hazard()
+	double row_sum = sum;
+	if (!table.preferences.empty()) {
+	  row_sum = 0.0;
+	  for (unsigned t = 0; t < n; ++t)
+	    row_sum += table.preferences[s * n + t] * share[t];
+	}
+	for (unsigned t = 0; t < n; ++t) {
+	  double w = table.preferences.empty() ? share[t]
+	    : table.preferences[s * n + t] * share[t];
+	  weights[t] = (1.0 - a) * (row_sum > 0.0 ? w / row_sum : 0.0)
+	    + (t == s ? a : 0.0);
+	}
+	rows[r * n + s].build(weights.data(), n);
+	double q = 0.0; // The average risk from a partner
+	for (unsigned t = 0; t < n; ++t)
+	  q += weights[t] * risk[r * n + t];
+	double expected = rate_new_partner
+	  * table.activity[s % table.num_risk_groups] * time_step;
+	prob_partner[r * n + s] = std::min(1.0, q > 0.0 ?
+	  (1.0 - exp(-expected * q)) / q : expected);
+      }
+    }
+  }
+
+  // The infection event for an agent
+  void event(Agent& a, Mixing& mixing, Generator& generator) const
+  {
+    if (a.hiv == 0) {
+      std::uniform_real_distribution<double> dist(0.0, 1.0);
+      if (dist(generator) < prob_partner[a.stratum]) {
+	const unsigned n = rows[a.stratum].size();
+	// The row's choices are the strata of the agent's region
+	unsigned partner = a.stratum / n * n
+	  + rows[a.stratum].sample(generator);
+	if (dist(generator) < risk[partner])
+	  mixing.infect(a);
+      }
+    }
+  }
+
+private:
+  std::vector<double> share, weights; // Work space for update()
+};
+
+// Regions
+
+// With NUM_REGIONS > 1 the population is split into regions, each with its
+// own force of infection (see Mixing). The agents of each region are kept
+// together in one block of the agents vector, region 0 first. A step works on
+// one block at a time, so a region's agents and its part of the mixing table
+// stay in cache while its events are done, and different regions can be done
+// by different threads. Each region has its own random number generator, so
+// the results don't depend on how many threads there are.
+//
+// The threads are a Workers pool (see workers.hh) of NUM_THREADS threads,
+// started by init() and pinned with PIN_THREADS, which summarize() uses too.
+// Thread t gets the t-th run of consecutive regions (none, if there are more
+// threads than regions), so with at least NUM_THREADS regions its agents are
+// the ones in chunk t of the agents vector, which NUMA_PLACEMENT = 2 put next
+// to CPU t.
+//
+// Once per step, after the events, agents move to another region (chosen
+// uniformly) at the annual rate MIGRATION_RATE. Rather than draw a random
+// number for every agent, we draw the number leaving each region from a
+// binomial distribution and take that many from the end of its block, which
+// is in random order because the block was shuffled at the start of the step.
+// Then the blocks are rebuilt in a second vector, which is swapped with the
+// first. So the agents move in memory on a step with any migration.
+
+class Regions {
+public:
+  // Region r is agents[start[r]] up to but not including agents[start[r + 1]]
+  std::vector<size_t> start;
+  std::vector<Generator> generators;
+  double migration_rate;
+  unsigned num_threads;
+  // Internal state
+  Population spare;
+  std::vector<size_t> leaving;
+  std::vector<size_t> cursor;
+  Workers workers;
+
+  unsigned size() const
+  {
+    return start.size() - 1;
+  }
+
+  bool migrating() const
+  {
+    return size() > 1 && migration_rate > 0.0;
+  }
+
+  // Split the agents into NUM_REGIONS blocks of (nearly) the same size, and
+  // seed each region's generator from generator. With one region this
+  // doesn't use any random numbers.
+  void assign(Population& agents,
+	      std::unordered_map<const char *, double>& parameters,
+	      Generator& generator)
+  {
+    unsigned num_regions = std::max(1.0, parameters["NUM_REGIONS"]);
+    start.resize(num_regions + 1);
+    for (unsigned r = 0; r <= num_regions; ++r)
+      start[r] = agents.size() * r / num_regions;
+    for (unsigned r = 0; r < num_regions; ++r)
+      for (size_t i = start[r]; i < start[r + 1]; ++i)
+	agents[i].region = r;
+    generators.resize(num_regions);
+    if (num_regions > 1)
+      for (auto &g : generators) {
+	// The seeds are the same in both runs of an antithetic pair
+	g.seed(generator.std::mt19937::operator()());
+	g.set_antithetic(generator.antithetic());
+      }
+    spare = Population(agents.get_allocator());
+  }
+
+  void init(std::unordered_map<const char *, double>& parameters)
+  {
+    migration_rate = parameters["MIGRATION_RATE"];
+    num_threads = std::max(1.0, parameters["NUM_THREADS"]);
+    workers.start(num_threads > 1 ? num_threads : 0,
+		  parameters["PIN_THREADS"] != 0.0);
+  }
+
+  // Call f(r) for each region r, sharing the regions out between the threads
+  template <class F> void for_each(F f)
+  {
+    const unsigned n = size();
+    const unsigned num = workers.size();
+    if (num == 0) {
+      for (unsigned r = 0; r < n; ++r)
+	f(r);
+      return;
+    }
+    auto work = [&f, n, num](const unsigned t) {
+      for (unsigned r = t * n / num; r < (t + 1) * n / num; ++r)
+	f(r);
+    };
+    workers.run(work);
+  }
+
+  void migrate(Population& agents, Mixing& mixing, const double time_step,
+	       Generator& generator)
+  {
+    if (!migrating())
+      return;
+    const unsigned n = size();
+    const double p = 1.0 - exp(-migration_rate * time_step);
+    std::uniform_int_distribution<unsigned> other(0, n - 2);
+    leaving.assign(n, 0);
+    cursor.assign(n, 0);
+    // Move the leavers to their new regions, and count the new block sizes
+    for (unsigned r = 0; r < n; ++r) {
+      std::binomial_distribution<size_t> dist(start[r + 1] - start[r], p);
+      leaving[r] = dist(generator);
+      cursor[r] += start[r + 1] - start[r] - leaving[r];
+      for (size_t i = start[r + 1] - leaving[r]; i < start[r + 1]; ++i) {
+	unsigned to = other(generator);
+	mixing.move(agents[i], to < r ? to : to + 1);
+	++cursor[agents[i].region];
+      }
+    }
+    // Then cursor[r] is where block r starts in spare
+    size_t begin = 0;
+    for (unsigned r = 0; r < n; ++r) {
+      size_t block = cursor[r];
+      cursor[r] = begin;
+      begin += block;
+    }
+    spare.resize(agents.size());
+    for (unsigned r = 0; r < n; ++r) {
+      size_t stay = start[r + 1] - leaving[r];
+      std::copy(agents.begin() + start[r], agents.begin() + stay,
+		spare.begin() + cursor[r]);
+      cursor[r] += stay - start[r];
+    }
+    for (unsigned r = 0; r < n; ++r)
+      for (size_t i = start[r + 1] - leaving[r]; i < start[r + 1]; ++i)
+	spare[cursor[agents[i].region]++] = agents[i];
+    for (unsigned r = 0; r < n; ++r)
+      start[r + 1] = cursor[r];
+    agents.swap(spare);
+  }
+};
+
+// Households
+
+// With HOUSEHOLD_SIZE > 0 the agents live in households. Each region's block
+// is cut into runs of consecutive agents, one per household, of size
+// 1 + Poisson(HOUSEHOLD_SIZE - 1), so HOUSEHOLD_SIZE is the average size. A
+// household is just a range of the agents vector: its members are next to
+// each other in memory, and they keep their places for the whole simulation.
+//
+// So when there are households the agents aren't shuffled on each step.
+// Nothing in a step depends on their order (the force of infection is worked
+// out before the events, and doesn't change while they're done), so this
+// doesn't bias anything; it just changes which random number each agent
+// gets. For the same reason nobody migrates when there are households, since
+// that would split them up.
+//
+// As well as the infection event, each uninfected agent is exposed to the
+// infected members of its household, each of whom infects them at the annual
+// rate RATE_HOUSEHOLD_TRANSMISSION. With n of them the probability of
+// infection in a step is 1 - (1 - p)^n, where p is
+// PROB_HOUSEHOLD_TRANSMISSION for the time step. The infected members are
+// counted before the household's events, so anyone infected in a step can't
+// pass it on until the next. The adaptive step size allows for this by
+// assuming the worst: an uninfected agent in the largest household, with
+// everyone else in it infected (see Stepper).
+
+inline void household_infection_event(Agent& a, const double risk,
+				      Mixing& mixing, Generator& generator)
+{
+  if (a.hiv == 0) {
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    if (dist(generator) < risk)
+      mixing.infect(a);
+  }
+}
+
+class Households {
+public:
+  // Household h is agents[start[h]] up to but not including
+  // agents[start[h + 1]]
+  std::vector<size_t> start;
+  // Region r's households are first[r] up to but not including first[r + 1]
+  std::vector<size_t> first;
+  size_t largest = 0; // The most members any household has
+
+  bool enabled() const
+  {
+    return !start.empty();
+  }
+
+  size_t size() const
+  {
+    return enabled() ? start.size() - 1 : 0;
+  }
+
+  // Cut each region's block into households. With HOUSEHOLD_SIZE = 0 (the
+  // default) there aren't any, and no random numbers are used.
+  void assign(const Population& agents, const Regions& regions,
+	      std::unordered_map<const char *, double>& parameters,
+	      Generator& generator)
+  {
+    start.clear();
+    first.clear();
+    largest = 0;
+    const double mean = parameters["HOUSEHOLD_SIZE"];
+    if (mean <= 0.0)
+      return;
+    // Only drawn from if mean > 1, and a Poisson mean has to be positive
+    std::poisson_distribution<size_t> others(mean > 1.0 ? mean - 1.0 : 1.0);
+    for (unsigned r = 0; r < regions.size(); ++r) {
+      first.push_back(start.size());
+      for (size_t i = regions.start[r]; i < regions.start[r + 1];) {
+	start.push_back(i);
+	size_t next = i + 1 + (mean > 1.0 ? others(generator) : 0);
+	next = std::min(next, regions.start[r + 1]);
+	largest = std::max(largest, next - i);
+	i = next;
+      }
+    }
+    first.push_back(start.size());
+    start.push_back(agents.size());
+  }
+
+  // The probability of infection from the rest of household h in a step,
+  // for its uninfected members
+  double risk(const size_t h, const Population& agents,
+	      const double prob_transmission) const
+  {
+    unsigned infected = 0;
+    for (size_t i = start[h]; i < start[h + 1]; ++i)
+      if (agents[i].hiv > 0)
+	++infected;
+    return infected > 0 ? 1.0 - pow(1.0 - prob_transmission, infected) : 0.0;
+  }
+};
+
+// Space
+
+// With SPATIAL_RADIUS > 0 every agent lives at a point (x, y) in the unit
+// square, which wraps round at the edges (so nobody lives at the edge of the
+// world). Each infected agent infects each uninfected agent within
+// SPATIAL_RADIUS of it at the annual rate RATE_SPATIAL_TRANSMISSION, so with
+// n infected agents in range the probability of infection in a step is
+// 1 - (1 - p)^n, as in a household. Agents move at the annual rate RATE_MOVE,
+// each time by a normally distributed distance with standard deviation
+// MOVE_DISTANCE along each axis.
+//
+// Checking the distance to every infected agent would take O(N^2) time per
+// step. Instead the square is divided into a grid of cells at least
+// SPATIAL_RADIUS wide, and each cell has a list of where the infected agents
+// in it are. Everyone in range of an agent is then in the agent's cell or one
+// of the eight around it.
+//
+// start() builds the grid, with the rows of cells shared out between the
+// threads. After that it's kept up to date as agents are infected and move:
+// each region's events make a list of the changes, and the lists are applied
+// after the events. So all the events of a step see the grid as it was at the
+// start of the step, and the regions' threads can all read it at once. The
+// grid only holds positions, not where the agents are in the agents vector,
+// so shuffling and migration don't affect it; when an infected agent moves,
+// its old entry is found by its old position. Anything else that changes
+// where the agents are, or who's infected, needs to call build() again.
+//
+// Placing the agents uses random numbers, so with SPATIAL_RADIUS = 0 (the
+// default) nobody is placed and the output is unchanged. If the simulation is
+// sharded each shard has a square of its own.
+
+class Space {
+public:
+  struct Point {
+    float x, y;
+  };
+  // A change to the grid: a newly infected agent at to, or an infected agent
+  // that's moved from from to to
+  struct Change {
+    Point from, to;
+    bool infected;
+  };
+  double radius;
+  double move_distance;
+  unsigned num_threads;
+  bool placed = false; // Whether assign() has placed the agents
+  unsigned size = 0; // Cells along each side, or 0 if there's no space
+  std::vector<std::vector<Point> > cells; // The cell in row r, column c is
+					  // cells[r * size + c]
+  std::vector<std::vector<Change> > changes; // For each region
+
+  bool enabled() const
+  {
+    return size > 0;
+  }
+
+  // Put the agents at random points. Does nothing with SPATIAL_RADIUS = 0.
+  void assign(Population& agents,
+	      std::unordered_map<const char *, double>& parameters,
+	      Generator& generator)
+  {
+    placed = parameters["SPATIAL_RADIUS"] > 0.0;
+    if (!placed)
+      return;
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+    for (auto &a : agents) {
+      a.x = wrap(dist(generator));
+      a.y = wrap(dist(generator));
+    }
+  }
+
+  void init(std::unordered_map<const char *, double>& parameters,
+	    const Population& agents, const unsigned num_regions)
+  {
+    radius = parameters["SPATIAL_RADIUS"];
+    move_distance = parameters["MOVE_DISTANCE"];
+    num_threads = std::max(1.0, parameters["NUM_THREADS"]);
+    size = 0;
+    changes.assign(num_regions, std::vector<Change>());
+    if (!placed || radius <= 0.0)
+      return;
+    // Cells no narrower than the radius, and not so many that most of them
+    // are empty. With fewer than three cells a side, the cells around a cell
+    // aren't all different, so then there's just one.
+    size = std::max(1.0, std::min(floor(1.0 / std::min(radius, 1.0)),
+				  ceil(sqrt((double) agents.size()))));
+    if (size < 3)
+      size = 1;
+    build(agents);
+  }
+
+  // Fill the grid from scratch. Each thread owns a band of rows of cells.
+  // First each thread goes through its own slice of the agents and sorts the
+  // infected ones' points by the band they fall in. Then each thread puts
+  // the points for its band into its cells, taking the slices in order, so
+  // every cell's points are in the same order as the agents whatever the
+  // number of threads.
+  void build(const Population& agents)
+  {
+    cells.assign((size_t) size * size, std::vector<Point>());
+    const unsigned num = std::min(num_threads, size);
+    // Points from slice t for band u are in buckets[t * num + u]
+    std::vector<std::vector<Point> > buckets((size_t) num * num);
+    auto band = [this, num](const float y) {
+      return (unsigned) ((size_t) index(y) * num / size);
+    };
+    auto sort = [this, &agents, &buckets, &band, num](const unsigned t) {
+      const size_t begin = agents.size() * t / num;
+      const size_t end = agents.size() * (t + 1) / num;
+      for (size_t i = begin; i < end; ++i) {
+	const Agent& a = agents[i];
+	if (a.hiv > 0)
+	  buckets[(size_t) t * num + band(a.y)].push_back({a.x, a.y});
+      }
+    };
+    auto fill = [this, &buckets, num](const unsigned u) {
+      for (unsigned t = 0; t < num; ++t)
+	for (auto &p : buckets[(size_t) t * num + u])
+	  cell(p).push_back(p);
+    };
+    in_threads(num, sort);
+    in_threads(num, fill);
+  }
+
+  // The most infected agents in any cell and the eight around it, which is
+  // the most there can be within the radius of anyone
+  size_t most_infected_near() const
+  {
+    const int n = size;
+    const int span = n >= 3 ? 1 : 0;
+    size_t most = 0;
+    for (int row = 0; row < n; ++row)
+      for (int column = 0; column < n; ++column) {
+	size_t infected = 0;
+	for (int r = row - span; r <= row + span; ++r)
+	  for (int c = column - span; c <= column + span; ++c)
+	    infected += cells[((r + n) % n) * (size_t) n + (c + n) % n].size();
+	most = std::max(most, infected);
+      }
+    return most;
+  }
+
+  // The number of infected agents within the radius of a
+  unsigned infected_near(const Agent& a) const
+  {
+    const int n = size;
+    const int span = n >= 3 ? 1 : 0;
+    const int row = index(a.y), column = index(a.x);
+    const float radius2 = radius * radius;
+    unsigned infected = 0;
+    for (int r = row - span; r <= row + span; ++r)
+      for (int c = column - span; c <= column + span; ++c)
+	for (auto &p : cells[((r + n) % n) * (size_t) n + (c + n) % n]) {
+	  float dx = fabs(p.x - a.x), dy = fabs(p.y - a.y);
+	  dx = std::min(dx, 1.0f - dx);
+	  dy = std::min(dy, 1.0f - dy);
+	  if (dx * dx + dy * dy < radius2)
+	    ++infected;
+	}
+    return infected;
+  }
+
+  // Infection from the agents nearby, then moving. was_infected says whether
+  // a was infected at the start of the step; changes to the grid go on
+  // changes.
+  void events(Agent& a, const bool was_infected, Mixing& mixing,
+	      const double prob_transmission, const double prob_move,
+	      std::vector<Change>& changes, Generator& generator) const
+  {
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    if (a.hiv == 0 && prob_transmission > 0.0) {
+      unsigned infected = infected_near(a);
+      if (infected > 0
+	  && dist(generator) < 1.0 - pow(1.0 - prob_transmission, infected))
+	mixing.infect(a);
+    }
+    const Point from = {a.x, a.y};
+    bool moved = false;
+    if (prob_move > 0.0 && dist(generator) < prob_move) {
+      std::normal_distribution<float> step(0.0f, move_distance);
+      a.x = wrap(a.x + step(generator));
+      a.y = wrap(a.y + step(generator));
+      moved = true;
+    }
+    if (a.hiv > 0 && (moved || !was_infected))
+      changes.push_back({from, {a.x, a.y}, !was_infected});
+  }
+
+  // Apply the changes the events made, a region at a time
+  void update()
+  {
+    for (auto &list : changes) {
+      for (auto &change : list) {
+	if (!change.infected)
+	  remove(change.from);
+	cell(change.to).push_back(change.to);
+      }
+      list.clear();
+    }
+  }
+
+private:
+  unsigned index(const float v) const
+  {
+    return std::min(size - 1, (unsigned) (v * size));
+  }
+
+  // Call work(t) for each t up to num, each in a thread of its own
+  template <class F> static void in_threads(const unsigned num, F work)
+  {
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t + 1 < num; ++t)
+      threads.push_back(std::thread(work, t));
+    work(num - 1); // The last one in this thread
+    for (auto &t : threads)
+      t.join();
+  }
+
+  std::vector<Point>& cell(const Point& p)
+  {
+    return cells[(size_t) index(p.y) * size + index(p.x)];
+  }
+
+  void remove(const Point& p)
+  {
+    std::vector<Point>& points = cell(p);
+    for (auto &q : points)
+      if (q.x == p.x && q.y == p.y) {
+	q = points.back();
+	points.pop_back();
+	return;
+      }
+  }
+
+  // Back into [0, 1)
+  static float wrap(float v)
+  {
+    v -= floor(v);
+    return v < 1.0f ? v : 0.0f;
+  }
+};
+
+// Testing campaigns
+
+// With TEST_EVERY > 0 there's a testing campaign every TEST_EVERY years, the
+// first TEST_EVERY years after the start. Each campaign tests TEST_COVERAGE of
+// each region's agents, chosen at random, and diagnoses the HIV+ ones who
+// haven't been diagnosed already. For now that's all: the numbers tested and
+// diagnosed are counted, but being diagnosed doesn't change anything. It's
+// where treatment would start.
+//
+// The agents to test are chosen with Subset (see sample.hh), so a campaign
+// takes time in proportion to the number tested, not to the population. A
+// region's agents are one block, so choosing from a region is just choosing
+// from a range of indices.
+
+class Campaign {
+public:
+  double every;
+  double coverage;
+  double next; // Date of the next campaign
+  // Totals over all the campaigns so far
+  size_t tested;
+  size_t diagnosed;
+  Subset subset;
+
+  bool enabled() const
+  {
+    return every > 0.0;
+  }
+
+  void init(std::unordered_map<const char *, double>& parameters,
+	    const double date, const size_t num_agents)
+  {
+    every = parameters["TEST_EVERY"];
+    coverage = std::min(1.0, std::max(0.0, parameters["TEST_COVERAGE"]));
+    next = date + every;
+    tested = 0;
+    diagnosed = 0;
+    // No region has more than all the agents
+    if (enabled())
+      subset.reserve(num_agents, llround(coverage * num_agents));
+  }
+
+  // Call once per step, after the step, with the date. Returns true if
+  // there should be a campaign now.
+  bool due(const double date)
+  {
+    if (!enabled() || date < next - 1e-9)
+      return false;
+    while (next <= date + 1e-9)
+      next += every;
+    return true;
+  }
+
+  void run(Population& agents, const Regions& regions,
+	   Generator& generator)
+  {
+    for (unsigned r = 0; r < regions.size(); ++r) {
+      const size_t begin = regions.start[r];
+      const size_t n = regions.start[r + 1] - begin;
+      for (auto i : subset.choose(n, llround(coverage * n), generator)) {
+	Agent& a = agents[begin + i];
+	++tested;
+	if (a.hiv > 0 && !a.diagnosed) {
+	  a.diagnosed = true;
+	  ++diagnosed;
+	}
+      }
+    }
+  }
+};
+
+// On each step of the iteration we want to do some reporting
+inline void report(double date,  const Population& agents)
+{
+  // Let's print the number infected
+  unsigned infected = 0;
+  for (auto& a: agents)
+    if (a.hiv > 0)
+      ++infected;
+  double prevalence = (double) infected / agents.size();
+  // In practise I reckon we'd want to generate this in CSV format
+  std::cout << date
+	    << " Num infected: " << infected << " Prevalence: " << prevalence
+	    << std::endl;
+}
+
+// Rates
+
+// It's easier to think about, and to find data for, annual rates than for
+// probabilities per time step. But the events need probabilities, and these
+// depend on the time step. If the rate of an event is r per year, then the
+// probability of it happening at least once in a time step of dt years is
+// 1 - exp(-r * dt).
+//
+// Rates does this conversion. Tell it which parameters are annual rates and
+// which parameters the probabilities should be stored in, e.g.
+//   rates.add("RATE_NEW_PARTNER", "PROB_NEW_PARTNER");
+// Then call load() once the parameters are set, prepare() with each step size
+// the simulation will use, and set_probabilities() with the time step. The
+// prepared probabilities are cached, so it's cheap to switch between step
+// sizes, and they're only recalculated if the rates are loaded again. Any
+// other step size (like a last step that's cut short) is worked out each time
+// it's asked for, in a vector that's reused, so asking doesn't allocate.
+//
+// The names are compared as strings, not as pointers, and asking for one
+// that isn't there throws std::invalid_argument, rather than quietly giving
+// 0 and, say, switching infection off.
+
+class Rates {
+public:
+  struct Rate {
+    const char *rate_name;
+    const char *prob_name;
+    double annual;
+  };
+  std::vector<Rate> rates;
+  // Time step -> the probability for each rate in the same order as rates
+  std::map<double, std::vector<double> > cache;
+
+  void add(const char *rate_name, const char *prob_name)
+  {
+    rates.push_back({rate_name, prob_name, 0.0});
+    cache.clear();
+  }
+
+  void load(std::unordered_map<const char *, double>& parameters)
+  {
+    for (auto &r : rates) {
+      auto it = parameters.begin();
+      while (it != parameters.end() && strcmp(it->first, r.rate_name) != 0)
+	++it;
+      if (it == parameters.end())
+	throw std::invalid_argument(std::string("No parameter called ")
+				    + r.rate_name);
+      r.annual = it->second;
+    }
+    cache.clear();
+    uncached.resize(rates.size());
+  }
+
+  void prepare(const double time_step)
+  {
+    if (cache.find(time_step) == cache.end()) {
+      std::vector<double> probs(rates.size());
+      work_out(time_step, probs);
+      cache.insert(std::make_pair(time_step, probs));
+    }
+  }
+
+  const std::vector<double>& probabilities(const double time_step)
+  {
+    auto it = cache.find(time_step);
+    if (it != cache.end())
+      return it->second;
+    work_out(time_step, uncached);
+    return uncached;
+  }
+
+  double probability(const char *prob_name, const double time_step)
+  {
+    const std::vector<double>& probs = probabilities(time_step);
+    for (size_t i = 0; i < rates.size(); ++i)
+      if (strcmp(rates[i].prob_name, prob_name) == 0)
+	return probs[i];
+    throw std::invalid_argument(std::string("No rate gives ") + prob_name);
+  }
+
+  void set_probabilities(std::unordered_map<const char *, double>& parameters,
+			 const double time_step)
+  {
+    const std::vector<double>& probs = probabilities(time_step);
+    for (size_t i = 0; i < rates.size(); ++i)
+      parameters[rates[i].prob_name] = probs[i];
+  }
+
+private:
+  std::vector<double> uncached; // For step sizes that weren't prepared
+
+  void work_out(const double time_step, std::vector<double>& probs) const
+  {
+    for (size_t i = 0; i < rates.size(); ++i)
+      probs[i] = 1.0 - exp(-rates[i].annual * time_step);
+  }
+};
+
+// We need several other events too presumably, including change of infection
+// status, arvs, death (unless we decide that over the short period we're
+// modelling death and infection status are not so important.
+
+// The simulation clock
+
+// Time is counted in whole ticks (by default one day each), not in years.
+// Floating point years don't add up exactly (365 steps of 1/365 years isn't
+// quite 1.0), and dividing NUM_YEARS by TIME_STEP and truncating can lose the
+// last step. With an integer count of ticks the number of steps is exact, and
+// the calendar date of any tick is one multiplication. TIME_STEP has to be a
+// whole number of ticks; start() throws std::invalid_argument if it isn't.
+
+class Clock {
+public:
+  double start_date; // Calendar date of tick 0, e.g. 2015.0
+  double tick; // Length of a tick in years
+  unsigned now; // Ticks elapsed since the start
+  unsigned end; // Tick at which the simulation stops
+
+  void init(std::unordered_map<const char *, double>& parameters)
+  {
+    start_date = parameters["START_DATE"];
+    tick = parameters["TICK"] > 0.0 ?
+      parameters["TICK"] : parameters["TIME_STEP"];
+    // to_ticks() would quietly round the time step, and then every
+    // probability would be for a step we don't take
+    const double ticks = parameters["TIME_STEP"] / tick;
+    if (!(ticks >= 0.5) || fabs(ticks - floor(ticks + 0.5)) > 1e-6 * ticks)
+      throw std::invalid_argument("TIME_STEP must be a whole number of TICKs");
+    now = 0;
+    end = to_ticks(parameters["NUM_YEARS"]);
+  }
+
+  // Nearest whole number of ticks to a period in years, at least one
+  unsigned to_ticks(const double years) const
+  {
+    return std::max(1.0, floor(years / tick + 0.5));
+  }
+
+  double to_years(const unsigned ticks) const
+  {
+    return ticks * tick;
+  }
+
+  // The date ahead ticks from now
+  double date(const unsigned ahead = 0) const
+  {
+    return start_date + (now + ahead) * tick;
+  }
+
+  unsigned remaining() const
+  {
+    return end - now;
+  }
+
+  bool done() const
+  {
+    return now >= end;
+  }
+
+  void advance(const unsigned ticks)
+  {
+    now += ticks;
+  }
+};
+
+// Choosing the time step
+
+// Normally every step is TIME_STEP long, except that the last step is cut
+// short if TIME_STEP doesn't divide NUM_YEARS.
+//
+// With ADAPTIVE_STEP set, we instead take the largest step for which no
+// agent's risk of infection in the step exceeds STEP_TOLERANCE. In quiet
+// periods (low prevalence) that means big steps, and as the epidemic grows the
+// steps get smaller. The risk is from the worst stratum's hazard (see Mixing)
+// plus an upper bound on the hazard from households and space, if there are
+// any: RATE_HOUSEHOLD_TRANSMISSION times one less than the largest household,
+// and RATE_SPATIAL_TRANSMISSION times the most infected agents around any
+// cell of the grid. The candidate steps are TIME_STEP, 2 * TIME_STEP,
+// 4 * TIME_STEP, ... up to MAX_TIME_STEP.
+//
+// Either way we keep a record of every step taken, in ticks, so that the
+// reports can be lined up with calendar dates.
+
+class Stepper {
+public:
+  bool adaptive;
+  std::vector<unsigned> ladder; // Candidate step sizes in ticks, smallest first
+  double tolerance;
+  std::vector<unsigned> steps; // Size of each step taken in ticks
+
+  void init(std::unordered_map<const char *, double>& parameters,
+	    const Clock& clock)
+  {
+    adaptive = parameters["ADAPTIVE_STEP"] != 0.0;
+    tolerance = parameters["STEP_TOLERANCE"];
+    ladder.clear();
+    steps.clear();
+    unsigned step = clock.to_ticks(parameters["TIME_STEP"]);
+    steps.reserve(clock.remaining() / std::max(1u, step) + 1);
+    unsigned max_step = adaptive ?
+      clock.to_ticks(parameters["MAX_TIME_STEP"]) : step;
+    do {
+      ladder.push_back(step);
+      step *= 2;
+    } while (step <= max_step);
+  }
+
+  // Choose the size in ticks of the next step. other_hazard is the bound on
+  // the annual hazard of infection from anything other than partners. In
+  // adaptive mode this works out mixing.hazard, so call mixing.update_force()
+  // with the chosen step afterwards.
+  unsigned next(Mixing& mixing, const double rate_new_partner,
+		const double force_infection, const double other_hazard,
+		const Clock& clock, Arena& scratch)
+  {
+    size_t i = 0;
+    if (adaptive) {
+      // The worst agent's risk in a step of dt years is at most
+      // 1 - exp(-max_hazard * dt)
+      mixing.update_hazard(rate_new_partner, force_infection, scratch);
+      double max_hazard = other_hazard
+	+ *std::max_element(mixing.hazard.begin(), mixing.hazard.end());
+      i = ladder.size() - 1;
+      while (i > 0 &&
+	     1.0 - exp(-max_hazard * clock.to_years(ladder[i])) > tolerance)
+	--i;
+    }
+    unsigned step = std::min(ladder[i], clock.remaining());
+    steps.push_back(step);
+    return step;
+  }
+};
+
+// Quantile sketches
+
+// To get the median age, say, we'd normally have to keep every agent's age
+// and sort them (or use nth_element). A sketch instead keeps a small sample
+// of the values it's given, from which any quantile can be estimated to
+// within about 1% of the rank. It uses a fixed amount of memory however many
+// values are added, values can be added one at a time as we go through the
+// agents, and two sketches can be merged. So each thread, or each run of the
+// simulation, can have its own sketch, and we merge them at the end.
+//
+// This is a KLL sketch (Karnin, Lang and Liberty, 2016). Values are added to
+// level 0. When a level is full it's sorted and every second value is moved
+// up to the next level, where each value stands for twice as many. The higher
+// levels get more space than the lower ones. The real KLL sketch tosses a coin
+// to decide whether to keep the odd or even values; we just alternate, so
+// that the sketch doesn't use up the simulation's random numbers.
+//
+// The levels aren't made until the first value is added, and clear() keeps
+// their memory for next time, so a sketch that's reused on every report
+// doesn't allocate once it's grown to size.
+
+class Sketch {
+public:
+  unsigned k; // Bigger k, more accurate, more memory
+  std::vector<std::vector<double> > levels;
+  std::vector<std::vector<double> > spare; // Cleared levels, for reuse
+  size_t count; // Number of values added
+  size_t size; // Number of values kept
+  size_t limit; // Number of values we can keep before compacting
+  bool odd;
+
+  Sketch(const unsigned k = 200) : k(k), count(0), size(0), limit(0), odd(false)
+  {
+  }
+
+  size_t capacity(const size_t level) const
+  {
+    size_t depth = levels.size() - level - 1;
+    return std::max(2.0, ceil(k * pow(2.0 / 3.0, depth)));
+  }
+
+  void update_limit()
+  {
+    limit = 0;
+    for (size_t h = 0; h < levels.size(); ++h)
+      limit += capacity(h);
+  }
+
+  void add_level()
+  {
+    if (spare.empty()) {
+      levels.resize(levels.size() + 1);
+    } else {
+      levels.push_back(std::move(spare.back()));
+      spare.pop_back();
+    }
+    update_limit();
+  }
+
+  void add(const double x)
+  {
+    if (levels.empty())
+      add_level();
+    levels[0].push_back(x);
+    ++count;
+    if (++size > limit)
+      compact();
+  }
+
+  // Halve the lowest level that's full
+  void compact()
+  {
+    for (size_t h = 0; h < levels.size(); ++h) {
+      if (levels[h].size() >= capacity(h)) {
+	if (h + 1 == levels.size())
+	  add_level();
+	std::vector<double>& level = levels[h];
+	std::sort(level.begin(), level.end());
+	// If there's an odd number of values, the biggest stays behind
+	size_t pairs = level.size() / 2;
+	for (size_t i = 0; i < pairs; ++i)
+	  levels[h + 1].push_back(level[2 * i + odd]);
+	level.erase(level.begin(), level.begin() + 2 * pairs);
+	size -= pairs;
+	odd = !odd;
+	return;
+      }
+    }
+  }
+
+  void merge(const Sketch& s)
+  {
+    while (levels.size() < s.levels.size())
+      add_level();
+    for (size_t h = 0; h < s.levels.size(); ++h)
+      levels[h].insert(levels[h].end(), s.levels[h].begin(), s.levels[h].end());
+    count += s.count;
+    size += s.size;
+    while (size > limit)
+      compact();
+  }
+
+  void clear()
+  {
+    for (auto &level : levels) {
+      level.clear();
+      spare.push_back(std::move(level));
+    }
+    levels.clear();
+    count = size = 0;
+    update_limit();
+  }
+
+  // q is between 0 and 1. The values are sorted in scratch, if given.
+  double quantile(const double q, Arena *scratch = nullptr) const
+  {
+    // Each value at level h stands for 2^h of the values added
+    Arena local;
+    typedef std::pair<double, size_t> Weighted;
+    std::vector<Weighted, ArenaAllocator<Weighted> >
+      weighted(scratch ? *scratch : local);
+    weighted.reserve(size);
+    size_t total = 0;
+    for (size_t h = 0; h < levels.size(); ++h)
+      for (auto x : levels[h]) {
+	weighted.push_back(std::make_pair(x, (size_t) 1 << h));
+	total += (size_t) 1 << h;
+      }
+    if (total == 0)
+      return NAN;
+    std::sort(weighted.begin(), weighted.end());
+    double rank = q * total;
+    size_t cumulative = 0;
+    for (auto &w : weighted) {
+      cumulative += w.second;
+      if (cumulative >= rank)
+	return w.first;
+    }
+    return weighted.back().first;
+  }
+};
+
+// Summary statistics
+
+// A Summary holds the demographics of a set of agents: how many men, how
+// many in each HIV stage, and the average, youngest and oldest age.
+// Summaries of different sets of agents can be merged, so we can split the
+// agents into chunks, summarise each chunk in its own thread, and merge the
+// results. The loop in add() has no if statements, which makes it easy for
+// the compiler to vectorise.
+//
+// If quantiles are asked for, the ages, and the time infected agents have
+// spent in their current stage, are added to sketches.
+
+class Summary {
+public:
+  size_t agents;
+  unsigned males;
+  unsigned hiv[6];
+  double total_age;
+  double youngest;
+  double oldest;
+  Sketch ages;
+  Sketch stage_times;
+
+  Summary() : agents(0), males(0), hiv(), total_age(0.0),
+	      youngest(HUGE_VAL), oldest(-HUGE_VAL) {}
+
+  void add(Population::const_iterator begin,
+	   Population::const_iterator end,
+	   const bool quantiles)
+  {
+    agents += end - begin;
+    for (auto it = begin; it < end; ++it) {
+      ++hiv[it->hiv];
+      males += it->sex == MALE;
+      total_age += it->age;
+      youngest = std::min(youngest, it->age);
+      oldest = std::max(oldest, it->age);
+    }
+    if (quantiles)
+      for (auto it = begin; it < end; ++it) {
+	ages.add(it->age);
+	if (it->hiv > 0)
+	  stage_times.add(it->age - it->stage_age);
+      }
+  }
+
+  void merge(const Summary& s)
+  {
+    agents += s.agents;
+    males += s.males;
+    for (size_t i = 0; i < 6; ++i)
+      hiv[i] += s.hiv[i];
+    total_age += s.total_age;
+    youngest = std::min(youngest, s.youngest);
+    oldest = std::max(oldest, s.oldest);
+    ages.merge(s.ages);
+    stage_times.merge(s.stage_times);
+  }
+
+  double average_age() const
+  {
+    return total_age / agents;
+  }
+};
+
+// The partial summaries are kept in scratch, if given. If workers are given
+// (the engine's, see Regions), thread t of the pool does chunk t, and it's
+// already pinned if the agents were. Otherwise a thread is started for each
+// chunk but the last, which the calling thread does. If the agents were
+// placed with pinning (see placement.hh), thread t is pinned to the same CPU
+// that chunk t was placed next to, and the calling thread is let go again
+// afterwards.
+inline Summary summarize(const Population& agents,
+		  unsigned num_threads = 1,
+		  const bool quantiles = false,
+		  Arena *scratch = nullptr,
+		  Workers *workers = nullptr)
+{
+  const bool pooled = workers && workers->size() > 0;
+  if (pooled)
+    num_threads = workers->size();
+  num_threads = std::max(1u, std::min<unsigned>(num_threads, agents.size()));
+  Arena local;
+  Arena& arena = scratch ? *scratch : local;
+  std::vector<Summary, ArenaAllocator<Summary> > partial(num_threads,
+							Summary(), arena);
+  size_t chunk = agents.size() / num_threads;
+  auto add = [&agents, &partial, num_threads, chunk, quantiles](
+      const unsigned t) {
+    if (t >= num_threads) // More threads in the pool than agents
+      return;
+    auto begin = agents.begin() + t * chunk;
+    auto end = t == num_threads - 1 ? agents.end() : begin + chunk;
+    partial[t].add(begin, end, quantiles);
+  };
+  if (pooled) {
+    workers->run(add);
+  } else {
+    std::vector<std::thread, ArenaAllocator<std::thread> > threads(arena);
+    threads.reserve(num_threads);
+    const bool pin = agents.get_allocator().placement.pin;
+    auto work = [&add, pin](const unsigned t) {
+      ThreadPin pinned(t, pin);
+      add(t);
+    };
+    for (unsigned t = 0; t + 1 < num_threads; ++t)
+      threads.push_back(std::thread(work, t));
+    work(num_threads - 1); // The last chunk in this thread
+    for (auto &t : threads)
+      t.join();
+  }
+  for (unsigned t = 1; t < num_threads; ++t)
+    partial[0].merge(partial[t]);
+  return std::move(partial[0]);
+}
+
+// Scheduled reporting
+
+// Printing a report on every step is a lot more output than we usually need.
+// Reporter decides when to report: every REPORT_EVERY steps, whenever the date
+// passes a multiple of REPORT_PERIOD years (e.g. 1.0 / 12 for monthly), or at
+// the end of the first step on or after each of the dates in the dates
+// vector. Set REPORT_EVERY or REPORT_PERIOD to 0 to turn that rule off.
+//
+// It also decides what to report. The number infected and the numbers of
+// males and females come straight from the mixing table, so they cost
+// nothing. The quantiles of age and of time spent in the current HIV stage
+// come from sketches that simulate() fills in as it goes through the agents
+// on a step that ends with a report. The HIV stage counts need the agents, so
+// they're calculated in a single pass by summarize().
+//
+// In a sharded simulation (see Engine::shard()) shard 0 does the reporting,
+// with the mixing table of all the shards combined. So the number infected
+// and the sexes are for the whole population, but the HIV stages and the
+// quantiles are for shard 0's agents only.
+
+enum Statistic {
+  INFECTED,
+  SEX,
+  STAGES,
+  AGE_QUANTILES,
+  STAGE_TIME_QUANTILES
+};
+
+class Reporter {
+public:
+  unsigned every;
+  double period;
+  std::vector<double> dates; // Must be in ascending order
+  std::vector<Statistic> statistics;
+  std::vector<double> quantiles;
+  unsigned num_threads;
+  Workers *workers = nullptr; // The threads for summarize(), if any
+  std::ostream *out = &std::cout; // Set to nullptr for no reports
+  // Internal state
+  size_t steps;
+  size_t next_date;
+  double last_date;
+  Summary summary;
+  Sketch ages;
+  Sketch stage_times;
+
+  void init(std::unordered_map<const char *, double>& parameters)
+  {
+    num_threads = parameters["NUM_THREADS"];
+    every = parameters["REPORT_EVERY"];
+    period = parameters["REPORT_PERIOD"];
+    statistics.clear();
+    statistics.push_back(INFECTED);
+    if (parameters["REPORT_SEX"])
+      statistics.push_back(SEX);
+    if (parameters["REPORT_STAGES"])
+      statistics.push_back(STAGES);
+    if (parameters["REPORT_AGE_QUANTILES"])
+      statistics.push_back(AGE_QUANTILES);
+    if (parameters["REPORT_STAGE_TIME_QUANTILES"])
+      statistics.push_back(STAGE_TIME_QUANTILES);
+    quantiles = {0.025, 0.25, 0.5, 0.75, 0.975};
+    start(parameters["START_DATE"]);
+  }
+
+  void start(const double date)
+  {
+    steps = 0;
+    next_date = 0;
+    last_date = date;
+    while (next_date < dates.size() && dates[next_date] <= date)
+      ++next_date;
+  }
+
+  // Call once per step, before the events, with the date the step ends
+  // on. Returns true if there should be a report at the end of the step.
+  bool due(const double date)
+  {
+    bool result = false;
+    ++steps;
+    if (every && steps % every == 0)
+      result = true;
+    if (period > 0.0 &&
+	floor(date / period + 1e-9) != floor(last_date / period + 1e-9))
+      result = true;
+    while (next_date < dates.size() && dates[next_date] <= date + 1e-9) {
+      ++next_date;
+      result = true;
+    }
+    last_date = date;
+    return result;
+  }
+
+  bool wants(const Statistic statistic) const
+  {
+    return std::find(statistics.begin(), statistics.end(), statistic)
+      != statistics.end();
+  }
+
+  // True if the agents should be passed to observe() on a reporting step
+  bool sketching() const
+  {
+    return wants(AGE_QUANTILES) || wants(STAGE_TIME_QUANTILES);
+  }
+
+  void observe(const Agent& a)
+  {
+    ages.add(a.age);
+    if (a.hiv > 0)
+      stage_times.add(a.age - a.stage_age);
+  }
+
+  // The one pass over the agents for the statistics that need it. If we're
+  // called outside simulate(), nobody has filled in the sketches, so the
+  // pass does that too.
+  void scan(const Population& agents, Arena *scratch = nullptr)
+  {
+    bool fill_sketches = sketching() && ages.count == 0;
+    if (wants(STAGES) || fill_sketches)
+      summary = summarize(agents, num_threads, fill_sketches, scratch,
+			  workers);
+    if (fill_sketches) {
+      ages = summary.ages;
+      stage_times = summary.stage_times;
+    }
+  }
+
+  void write(const double date, const Population& agents,
+	     const Mixing& mixing, Arena *scratch = nullptr)
+  {
+    scan(agents, scratch);
+    std::ostream& out = *this->out;
+    out << date;
+    for (auto statistic : statistics) {
+      switch (statistic) {
+      case INFECTED: {
+	unsigned infected = mixing.num_infected();
+	out << " Num infected: " << infected
+		  << " Prevalence: " << (double) infected / mixing.population();
+	break;
+      }
+      case SEX: {
+	unsigned males = mixing.num_males();
+	out << " Males: " << males
+		  << " Females: " << mixing.population() - males;
+	break;
+      }
+      case STAGES:
+	for (size_t i = 0; i < 6; ++i)
+	  out << " HIV " << i << ": " << summary.hiv[i];
+	break;
+      case AGE_QUANTILES:
+	for (auto q : quantiles)
+	  out << " Age " << q * 100 << "%: " << ages.quantile(q, scratch);
+	break;
+      case STAGE_TIME_QUANTILES:
+	for (auto q : quantiles)
+	  out << " Years in stage " << q * 100 << "%: "
+		    << stage_times.quantile(q, scratch);
+	break;
+      }
+    }
+    out << std::endl;
+    ages.clear();
+    stage_times.clear();
+  }
+};
+
+inline void print_verbose_agent_info(Population& agents,
+			      const unsigned num_threads = 1)
+{
+  Summary summary = summarize(agents, num_threads);
+  std::cout << "Males: " << summary.males << std::endl;
+  std::cout << "Youngest: " << summary.youngest << std::endl;
+  std::cout << "Oldest: " << summary.oldest << std::endl;
+  std::cout << "Average age: " << summary.average_age() << std::endl;
+  for (size_t i = 0; i < 6; ++i)
+    std::cout << "HIV " << i << " " << summary.hiv[i] << std::endl;
+}
+
+// Parameters
+
+// It makes sense to keep the simulation parameters in a hash table which is
+// an unordered_map in the c++ STL. Note that the keys are pointers to the
+// names, not the names themselves, so look them up with the names in quotes,
+// e.g. parameters["NUM_YEARS"]. If you've got a name from somewhere else,
+// like the command line, use set_parameter().
+
+inline void
+set_default_parameters(std::unordered_map<const char *, double>& parameters)
+{
+  // I've just set these arbitrarily. More work needed on this
+  parameters["NUM_AGENTS"] = 10000;
+  // Arbitrarily chosen seed for our Mersenne Twister. Note by seeding with
+  // a fixed number, we get the same output on every execution, which is
+  // usually what we want.
+  // To seed based on time, check out this code:
+  // http://www.cplusplus.com/reference/random/mersenne_twister_engine/seed/
+  parameters["SEED"] = 23;
+  parameters["NUM_YEARS"] = 2.0;
+  parameters["TICK"] = 1.0 / YEAR; // Resolution of the simulation clock
+  parameters["TIME_STEP"] = 1.0 / YEAR; // 1 day
+  parameters["START_DATE"] = 2015.0;
+  // Arbitrarily chosen annual rate of new partners. This works out to a
+  // 2.2% chance of a new partner on any given day. PROB_NEW_PARTNER is
+  // calculated from it for whatever the TIME_STEP is, and the force of
+  // infection is converted to a risk per step from the annual hazard it
+  // makes with FORCE_INFECTION (see Mixing).
+  parameters["RATE_NEW_PARTNER"] = -YEAR * log(1.0 - 0.022);
+  parameters["FORCE_INFECTION"] = 0.1; // 10% risk infection with HIV+ partner
+  // Mixing structure. With these values everyone mixes with everyone
+  // else, which is the same as having a single prevalence.
+  parameters["NUM_AGE_BANDS"] = 8; // 15-19, 20-24, ..., 50+
+  parameters["MIN_AGE_BAND"] = 15.0;
+  parameters["AGE_BAND_WIDTH"] = 5.0;
+  parameters["NUM_RISK_GROUPS"] = 1;
+  parameters["RISK_ACTIVITY_RATIO"] = 4.0; // Only used if > 1 risk group
+  parameters["ASSORTATIVITY"] = 0.0; // 0 = proportionate, 1 = fully assortative
+  parameters["AGE_PREFERENCE"] = 0.0; // Years; 0 = no preference for age
+  // Set to 1 to choose each new partner's stratum (see Partners)
+  parameters["PARTNER_CHOICE"] = 0;
+  // Years between testing campaigns, 0 for none, and the fraction of the
+  // agents each one tests (see Campaign)
+  parameters["TEST_EVERY"] = 0.0;
+  parameters["TEST_COVERAGE"] = 0.05;
+  // Set to 1 to give each random process its own stream, for comparing
+  // scenarios, and ANTITHETIC to 1 for the other run of an antithetic pair
+  // (see Streams)
+  parameters["COMMON_RANDOM_NUMBERS"] = 0;
+  parameters["ANTITHETIC"] = 0;
+  // Set ADAPTIVE_STEP to 1 to let the step size grow up to MAX_TIME_STEP
+  // while no agent's risk of infection in a step is above STEP_TOLERANCE.
+  parameters["ADAPTIVE_STEP"] = 0;
+  parameters["MAX_TIME_STEP"] = 32.0 / YEAR;
+  parameters["STEP_TOLERANCE"] = 0.001;
+  // Report on every step. Try REPORT_EVERY = 0 and REPORT_PERIOD = 1.0 / 12
+  // for monthly reports. Set the REPORT_ flags to 1 for more statistics.
+  parameters["REPORT_EVERY"] = 1;
+  parameters["REPORT_PERIOD"] = 0.0;
+  parameters["REPORT_SEX"] = 0;
+  parameters["REPORT_STAGES"] = 0;
+  parameters["REPORT_AGE_QUANTILES"] = 0;
+  parameters["REPORT_STAGE_TIME_QUANTILES"] = 0;
+  // Threads used for calculating statistics
+  parameters["NUM_THREADS"] = std::thread::hardware_concurrency();
+  // Where the agents go in memory on a machine with several NUMA nodes (see
+  // placement.hh): 0 on the heap, 1 interleaved over the nodes, 2 each of
+  // the NUM_THREADS chunks on the node of the thread that works on it. Set
+  // PIN_THREADS to 1 to keep each thread on its own CPU.
+  parameters["NUMA_PLACEMENT"] = 0;
+  parameters["PIN_THREADS"] = 0;
+  // Put the agents in 2 MiB pages: 0 no, 1 transparent huge pages, 2 the
+  // huge pages reserved in /proc/sys/vm/nr_hugepages, or transparent ones if
+  // there aren't enough. Worth it with millions of agents.
+  parameters["HUGE_PAGES"] = 0;
+  // Number of processes to split the agents between (see Engine::shard())
+  parameters["NUM_SHARDS"] = 1;
+  // Number of regions, each with its own force of infection, and the annual
+  // rate at which agents move between them (see Regions)
+  parameters["NUM_REGIONS"] = 1;
+  parameters["MIGRATION_RATE"] = 0.0;
+  // Average household size, 0 for no households, and the annual rate at
+  // which each infected member infects each of the others (see Households)
+  parameters["HOUSEHOLD_SIZE"] = 0;
+  parameters["RATE_HOUSEHOLD_TRANSMISSION"] = 0.1;
+  // Distance over which infection spreads in space, 0 for no space, the
+  // annual rate of infection by each infected agent in range, and how often
+  // and how far agents move (see Space). Space is a unit square.
+  parameters["SPATIAL_RADIUS"] = 0.0;
+  parameters["RATE_SPATIAL_TRANSMISSION"] = 0.5;
+  parameters["RATE_MOVE"] = 0.2;
+  parameters["MOVE_DISTANCE"] = 0.05;
+  // Only used if compiled with TUTSIM_INSTRUMENT (see instrument.hh): set to
+  // 0 to switch the timers and counters off.
+  parameters["INSTRUMENT"] = 1;
+  // Also measure each phase with the hardware performance counters, where
+  // the system allows it
+  parameters["PERF_COUNTERS"] = 1;
+}
+
+// Set the parameter called name. Returns false if there's no such parameter.
+inline bool
+set_parameter(std::unordered_map<const char *, double>& parameters,
+	      const std::string& name, const double value)
+{
+  for (auto &p : parameters)
+    if (name == p.first) {
+      p.second = value;
+      return true;
+    }
+  return false;
+}
+
+// The simulation engine
+
+// Engine puts all of the above together. To use it:
+//
+//   Engine engine; // Sets the default parameters
+//   engine.parameters["NUM_YEARS"] = 5.0; // Change any you like
+//   engine.create(); // Create the population
+//   engine.start(); // Get ready to simulate
+//   engine.simulate(); // Or: while (engine.step()) { ... }
+//   std::cout << engine.prevalence() << std::endl;
+//
+// The reports go to engine.reporter.out, which is std::cout unless you
+// change it.
+
+class Engine {
+public:
+  std::unordered_map<const char *, double> parameters;
+  Generator generator;
+  Population agents;
+  Rates rates;
+  Clock clock;
+  Mixing mixing;
+  Stepper stepper;
+  Reporter reporter;
+  Regions regions;
+  Households households;
+  Space space;
+  Partners partners;
+  Campaign campaign;
+  Streams streams;
+  // Scratch memory for each thread, emptied at the end of every step (see
+  // arena.hh). The thread running step() uses scratch[0].
+  std::vector<Arena> scratch;
+  // If the simulation is split over several processes (see shard()), the
+  // shared memory, and the mixing table of all the shards combined
+  Shards shards;
+  Mixing combined;
+#ifdef TUTSIM_INSTRUMENT
+  Instruments instruments;
+#endif
+
+  Engine()
+  {
+    set_default_parameters(parameters);
+    rates.add("RATE_NEW_PARTNER", "PROB_NEW_PARTNER");
+    rates.add("RATE_HOUSEHOLD_TRANSMISSION", "PROB_HOUSEHOLD_TRANSMISSION");
+    rates.add("RATE_SPATIAL_TRANSMISSION", "PROB_SPATIAL_TRANSMISSION");
+    rates.add("RATE_MOVE", "PROB_MOVE");
+  }
+
+  // Split the simulation over NUM_SHARDS processes on this machine (see
+  // shard.hh). Call before create(). Each process returns from here with its
+  // own shard of the agents to create and simulate. They all have to run the
+  // same number of steps, and only shard 0 makes reports, so once it's
+  // finished, shard 0 should call shards.wait() and the others should exit.
+  // Returns false if the shared memory couldn't be set up.
+  bool shard()
+  {
+    unsigned num_shards = std::max(1.0, parameters["NUM_SHARDS"]);
+    if (num_shards == 1)
+      return true;
+    // Each shard contributes the total and number infected in each stratum
+    unsigned num_strata = 2 * std::max(1.0, parameters["NUM_REGIONS"])
+      * std::max(1.0, parameters["NUM_AGE_BANDS"])
+      * std::max(1.0, parameters["NUM_RISK_GROUPS"]);
+    if (!shards.open(num_shards, 2 * num_strata))
+      return false;
+    if (shards.fork() != 0)
+      reporter.out = nullptr;
+    return true;
+  }
+
+  bool sharded() const
+  {
+    return shards.num_shards > 1;
+  }
+
+  // Create NUM_AGENTS agents, with the generator seeded with SEED, placed in
+  // memory as NUMA_PLACEMENT, PIN_THREADS and HUGE_PAGES say. If sharded,
+  // this creates just this shard's agents, and each shard gets its own
+  // random numbers.
+  void create()
+  {
+    size_t num_agents = parameters["NUM_AGENTS"];
+    if (sharded()) {
+      size_t first = num_agents * shards.shard / shards.num_shards;
+      size_t last = num_agents * (shards.shard + 1) / shards.num_shards;
+      num_agents = last - first;
+      std::seed_seq seed{(unsigned) parameters["SEED"], shards.shard};
+      generator.seed(seed);
+    } else {
+      generator.seed(parameters["SEED"]);
+    }
+    streams.seed(parameters, shards.shard);
+    generator.set_antithetic(streams.antithetic);
+    Placement placement;
+    placement.mode = (PlacementMode) std::min(2.0, std::max(0.0,
+      parameters["NUMA_PLACEMENT"]));
+    placement.num_threads = std::max(1.0, parameters["NUM_THREADS"]);
+    placement.pin = parameters["PIN_THREADS"] != 0.0;
+    placement.huge_pages = (HugePages) std::min(2.0, std::max(0.0,
+      parameters["HUGE_PAGES"]));
+    agents = Population(num_agents, Agent(),
+			PopulationAllocator<Agent>(placement));
+    initialize_agents(agents, generator);
+    assign_risk_groups(agents, parameters, generator);
+    regions.assign(agents, parameters, generator);
+    households.assign(agents, regions, parameters, generator);
+    space.assign(agents, parameters, generator);
+  }
+
+  // Call after create() and after changing any parameters. Reports will be
+  // made on any dates put in reporter.dates before this is called.
+  void start()
+  {
+    rates.load(parameters);
+    clock.init(parameters);
+    regions.init(parameters);
+    if (households.enabled())
+      regions.migration_rate = 0.0; // It would split the households up
+    space.init(parameters, agents, regions.size());
+    mixing.init(agents, parameters);
+    partners.init(parameters, mixing);
+    stepper.init(parameters, clock);
+    if (sharded()) {
+      combined = mixing;
+      exchange();
+    }
+    for (auto step : stepper.ladder)
+      rates.prepare(clock.to_years(step));
+    // Convert the annual rates to probabilities for the time step we take
+    rates.set_probabilities(parameters, clock.to_years(stepper.ladder[0]));
+    reporter.init(parameters);
+    reporter.workers = &regions.workers;
+    reporter.start(clock.date());
+    campaign.init(parameters, clock.date(), agents.size());
+    streams.init(parameters);
+    scratch.resize(std::max(1.0, parameters["NUM_THREADS"]));
+#ifdef TUTSIM_INSTRUMENT
+    instruments.enabled = parameters["INSTRUMENT"] != 0.0;
+    if (instruments.enabled && parameters["PERF_COUNTERS"])
+      instruments.open_counters();
+#endif
+  }
+
+  // This is the simulation logic for one time step. Returns false once
+  // the simulation is over.
+  bool step()
+  {
+    if (clock.done())
+      return false;
+    // The agents visited and the infections are worked out from the mixing
+    // table here, rather than in the loops, so that they don't slow the
+    // loops down. The generators count their own random numbers.
+    unsigned infected_before = 0;
+    unsigned long long draws_before = 0;
+    const bool shuffling = !households.enabled();
+    INSTRUMENT(instruments,
+	       instruments.start_step();
+	       infected_before = mixing.num_infected();
+	       draws_before = random_draws();
+	       instruments.count(AGENTS_VISITED, agents.size()));
+    (void) infected_before;
+    (void) draws_before;
+
+    if (shuffling) {
+      INSTRUMENT_PHASE(instruments, PHASE_SHUFFLE);
+      // So that there's no bias because of the original order of the agents
+      // we shuffle them. For complex partner matching, this is vital. But
+      // households keep their places (see Households).
+      if (regions.size() == 1)
+	shuffle(agents.begin(), agents.end(), generator);
+      else
+	regions.for_each([this](const unsigned r) {
+	    shuffle(agents.begin() + regions.start[r],
+		    agents.begin() + regions.start[r + 1],
+		    regions.generators[r]);
+	  });
+    }
+
+    // If sharded, the force of infection comes from all the shards' counts
+    Mixing& table = sharded() ? combined : mixing;
+    unsigned step;
+    double time_step;
+    {
+      INSTRUMENT_PHASE(instruments, PHASE_FORCE);
+      const double rate_new_partner = parameters["RATE_NEW_PARTNER"];
+      const double force_infection = parameters["FORCE_INFECTION"];
+      // The shards have to agree on the step, so if sharded this is the
+      // largest of their bounds, from the last exchange()
+      double other_hazard = 0.0;
+      if (stepper.adaptive)
+	other_hazard = sharded() ? shards.largest : other_hazard_bound();
+      step = stepper.next(table, rate_new_partner, force_infection,
+			  other_hazard, clock, scratch[0]);
+      time_step = clock.to_years(step);
+      // For the infection event we need the prevalence in each stratum. The
+      // mixing table already has the counts, so this doesn't touch the
+      // agents. Note that if agents die, then Mixing needs a remove() method.
+      table.update_force(rate_new_partner, force_infection, time_step,
+			 scratch[0]);
+      if (sharded())
+	std::copy(combined.force.begin(), combined.force.end(),
+		  mixing.force.begin());
+      if (partners.enabled())
+	partners.update(table, rate_new_partner, force_infection, time_step);
+    }
+    bool reporting = reporter.due(clock.date(step)) && reporter.out;
+    bool sketching = reporting && reporter.sketching();
+
+    {
+      INSTRUMENT_PHASE(instruments, PHASE_EVENTS);
+      // Now iterate through the agents, doing events
+      if (households.enabled() || space.enabled() || partners.enabled()
+	  || streams.common) {
+	// A household (or an agent) at a time, each region with its own
+	// generator, as below
+	const double prob_household =
+	  rates.probability("PROB_HOUSEHOLD_TRANSMISSION", time_step);
+	const double prob_spatial =
+	  rates.probability("PROB_SPATIAL_TRANSMISSION", time_step);
+	const double prob_move = rates.probability("PROB_MOVE", time_step);
+	auto range_events = [this, time_step, prob_spatial, prob_move](
+	    const size_t begin, const size_t end, const double household_risk,
+	    std::vector<Space::Change>& changes, Generator& generator) {
+	  for (size_t i = begin; i < end; ++i) {
+	    Agent& a = agents[i];
+	    const bool was_infected = a.hiv > 0;
+	    if (partners.enabled())
+	      partners.event(a, mixing, generator);
+	    else if (streams.common)
+	      common_infection_event(a, mixing, generator);
+	    else
+	      infection_event(a, mixing, generator);
+	    if (household_risk > 0.0)
+	      household_infection_event(a, household_risk, mixing, generator);
+	    if (space.enabled())
+	      space.events(a, was_infected, mixing, prob_spatial, prob_move,
+			   changes, generator);
+	    age_event(a, time_step, mixing);
+	  }
+	};
+	auto region_events = [this, prob_household, &range_events](
+	    const unsigned r, Generator& region_generator) {
+	  std::vector<Space::Change>& changes = space.changes[r];
+	  if (!households.enabled())
+	    range_events(regions.start[r], regions.start[r + 1], 0.0, changes,
+			 region_generator);
+	  else
+	    for (size_t h = households.first[r]; h < households.first[r + 1];
+		 ++h)
+	      range_events(households.start[h], households.start[h + 1],
+			   households.risk(h, agents, prob_household), changes,
+			   region_generator);
+	};
+	if (regions.size() == 1)
+	  region_events(0, streams.choose(streams.events, generator));
+	else
+	  regions.for_each([this, &region_events](const unsigned r) {
+	      region_events(r, regions.generators[r]);
+	    });
+	if (space.enabled())
+	  space.update();
+	if (sketching)
+	  for (auto &a : agents)
+	    reporter.observe(a);
+      } else if (regions.size() == 1) {
+	for (auto & a: agents) {
+	  infection_event(a, mixing, generator);
+	  age_event(a, time_step, mixing);
+	  if (sketching)
+	    reporter.observe(a);
+	}
+      } else {
+	// Each region only touches its own strata in the mixing table, so
+	// the regions can be done at the same time
+	regions.for_each([this, time_step](const unsigned r) {
+	    Generator& region_generator = regions.generators[r];
+	    for (size_t i = regions.start[r]; i < regions.start[r + 1]; ++i) {
+	      infection_event(agents[i], mixing, region_generator);
+	      age_event(agents[i], time_step, mixing);
+	    }
+	  });
+	if (sketching)
+	  for (auto &a : agents)
+	    reporter.observe(a);
+      }
+    }
+    if (regions.migrating()) {
+      INSTRUMENT_PHASE(instruments, PHASE_MIGRATE);
+      regions.migrate(agents, mixing, time_step,
+		      streams.choose(streams.migration, generator));
+    }
+    clock.advance(step);
+    if (campaign.due(clock.date())) {
+      INSTRUMENT_PHASE(instruments, PHASE_CAMPAIGN);
+      size_t tested_before = campaign.tested;
+      campaign.run(agents, regions,
+		   streams.choose(streams.campaign, generator));
+      INSTRUMENT(instruments,
+		 instruments.count(AGENTS_VISITED,
+				   campaign.tested - tested_before));
+      (void) tested_before;
+    }
+    if (sharded()) {
+      INSTRUMENT_PHASE(instruments, PHASE_EXCHANGE);
+      exchange();
+    }
+    if (reporting) {
+      INSTRUMENT_PHASE(instruments, PHASE_REPORT);
+      reporter.write(clock.date(), agents, table, &scratch[0]);
+    }
+    for (auto &arena : scratch)
+      arena.reset();
+    INSTRUMENT(instruments,
+	       instruments.count(INFECTIONS,
+				 mixing.num_infected() - infected_before);
+	       instruments.count(RANDOM_DRAWS, random_draws() - draws_before);
+	       instruments.end_step(clock.date()));
+    return !clock.done();
+  }
+
+  void simulate()
+  {
+    while (step())
+      ;
+  }
+
+  // The bound on the annual hazard of infection from households and space
+  // for the adaptive step size (see Stepper), for this process's agents
+  double other_hazard_bound()
+  {
+    double hazard = 0.0;
+    if (households.enabled())
+      hazard += parameters["RATE_HOUSEHOLD_TRANSMISSION"]
+	* (households.largest - 1);
+    if (space.enabled())
+      hazard += parameters["RATE_SPATIAL_TRANSMISSION"]
+	* space.most_infected_near();
+    return hazard;
+  }
+
+  // Swap counts with the other shards, and add them up in combined. The
+  // shards' bounds for the adaptive step go along too, and the largest ends
+  // up in shards.largest.
+  void exchange()
+  {
+    const unsigned n = mixing.num_strata();
+    unsigned *slot = shards.slot();
+    std::copy(mixing.total.begin(), mixing.total.end(), slot);
+    std::copy(mixing.infected.begin(), mixing.infected.end(), slot + n);
+    shards.high() = stepper.adaptive ? other_hazard_bound() : 0.0;
+    const std::vector<unsigned>& sums = shards.exchange();
+    std::copy(sums.begin(), sums.begin() + n, combined.total.begin());
+    std::copy(sums.begin() + n, sums.begin() + 2 * n,
+	      combined.infected.begin());
+  }
+
+#ifdef TUTSIM_INSTRUMENT
+  // The random numbers all of this engine's generators have given so far
+  unsigned long long random_draws() const
+  {
+    unsigned long long draws = generator.draws + streams.events.draws
+      + streams.migration.draws + streams.campaign.draws;
+    for (auto &g : regions.generators)
+      draws += g.draws;
+    return draws;
+  }
+#endif
+
+  // Statistics
+
+  double date() const
+  {
+    return clock.date();
+  }
+
+  // These are for all the shards, if sharded
+
+  unsigned infected() const
+  {
+    return (sharded() ? combined : mixing).num_infected();
+  }
+
+  double prevalence() const
+  {
+    return (double) infected() / (sharded() ? combined : mixing).population();
+  }
+
+  Summary summary(const bool quantiles = false)
+  {
+    return summarize(agents, parameters["NUM_THREADS"], quantiles, nullptr,
+		     &regions.workers);
+  }
+};
+
+// Additional Notes
+
+// To append a new agent, x, to the vector of agents:
+// agents.push_back(x)
+
+// Perhaps, a more efficient way to declare the agents, especially
+// since we shuffle them on every iteration is this:
+// vector<Agent *> agents
+// But then you have to learn a bit about pointers, and I'm not sure the gain in
+// effciency is worth the additional coding complexity.
+
+#endif
@@ -0,0 +1,529 @@
+// Python bindings for the simulation in tutsim.hh.
+//
+// Build with "make python", which leaves tutsimcc*.so in this directory. Then:
+//
+//   import tutsimcc
+//   engine = tutsimcc.Engine(NUM_AGENTS=100000, NUM_YEARS=5)
+//   engine.create()
+//   engine.start()
+//   while engine.step():
+//       print(engine.date, engine.prevalence, engine.age.mean())
+//
+// engine.age, engine.sex, engine.hiv, engine.risk, engine.region, engine.x,
+// engine.y and engine.stage_age are NumPy arrays (or memoryviews if NumPy
+// isn't installed) that look straight at the agents in the C++ engine.
+// Nothing is copied, and changes made to the arrays change the agents.
+// Remember that the agents are shuffled on every step, so position i isn't
+// the same agent from one step to the next, but the columns always line up
+// with each other.
+//
+// step() and simulate() release the GIL, so other Python threads can run
+// while the engine works. Don't use the same Engine from two threads at once.
+// An error in the engine, like a bad parameter, raises ValueError.
+//
+// The module runs the whole population in this process, so NUM_SHARDS can't
+// be more than 1 (see Engine::shard() in tutsim.hh).
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#include <cstddef> // offsetof
+#include <cstring> // strcmp
+#include <string>
+
+#include "tutsim.hh"
+
+static_assert(sizeof(Sex) == sizeof(int), "Sex column is exported as int");
+
+typedef struct {
+  PyObject_HEAD
+  Engine *engine;
+  Py_ssize_t exports; // Number of column buffers in use
+} EngineObject;
+
+// A column is a strided view of one field of every agent
+typedef struct {
+  PyObject_HEAD
+  EngineObject *owner;
+  size_t offset;
+  const char *format;
+  Py_ssize_t itemsize;
+  Py_ssize_t shape;
+  Py_ssize_t stride;
+} ColumnObject;
+
+static PyTypeObject ColumnType = { PyVarObject_HEAD_INIT(NULL, 0) };
+static PyTypeObject EngineType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+// numpy.asarray, or None if NumPy isn't installed
+static PyObject *asarray = NULL;
+
+// Columns
+
+static int
+Column_getbuffer(ColumnObject *self, Py_buffer *view, int flags)
+{
+  if ((flags & PyBUF_STRIDES) != PyBUF_STRIDES) {
+    PyErr_SetString(PyExc_BufferError, "agent columns are strided");
+    return -1;
+  }
+  Population& agents = self->owner->engine->agents;
+  self->shape = agents.size();
+  self->stride = sizeof(Agent);
+  view->buf = (char *) agents.data() + self->offset;
+  view->obj = (PyObject *) self;
+  Py_INCREF(self);
+  view->len = self->shape * self->itemsize;
+  view->readonly = 0;
+  view->itemsize = self->itemsize;
+  view->format = (flags & PyBUF_FORMAT) ? (char *) self->format : NULL;
+  view->ndim = 1;
+  view->shape = &self->shape;
+  view->strides = &self->stride;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  ++self->owner->exports;
+  return 0;
+}
+
+static void
+Column_releasebuffer(ColumnObject *self, Py_buffer *view)
+{
+  --self->owner->exports;
+}
+
+static void
+Column_dealloc(ColumnObject *self)
+{
+  Py_XDECREF(self->owner);
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyBufferProcs Column_as_buffer = {
+  (getbufferproc) Column_getbuffer,
+  (releasebufferproc) Column_releasebuffer
+};
+
+static PyObject *
+make_column(EngineObject *owner, size_t offset, const char *format,
+	    Py_ssize_t itemsize)
+{
+  ColumnObject *column = PyObject_New(ColumnObject, &ColumnType);
+  if (column == NULL)
+    return NULL;
+  Py_INCREF(owner);
+  column->owner = owner;
+  column->offset = offset;
+  column->format = format;
+  column->itemsize = itemsize;
+  column->shape = 0;
+  column->stride = sizeof(Agent);
+  PyObject *result;
+  if (asarray != Py_None)
+    result = PyObject_CallFunctionObjArgs(asarray, column, NULL);
+  else
+    result = PyMemoryView_FromObject((PyObject *) column);
+  Py_DECREF(column);
+  return result;
+}
+
+#define COLUMN(field, format)						\
+  static PyObject *							\
+  Engine_get_##field(EngineObject *self, void *closure)			\
+  {									\
+    return make_column(self, offsetof(Agent, field), format,		\
+		       sizeof(((Agent *) 0)->field));			\
+  }
+
+COLUMN(age, "d")
+COLUMN(sex, "i")
+COLUMN(hiv, "I")
+COLUMN(risk, "I")
+COLUMN(region, "I")
+COLUMN(x, "f")
+COLUMN(y, "f")
+COLUMN(stage_age, "d")
+
+// Engine
+
+static int
+set_parameters(Engine *engine, PyObject *kwds)
+{
+  if (kwds == NULL)
+    return 0;
+  PyObject *key, *value;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(kwds, &pos, &key, &value)) {
+    const char *name = PyUnicode_AsUTF8(key);
+    if (name == NULL)
+      return -1;
+    double x = PyFloat_AsDouble(value);
+    if (x == -1.0 && PyErr_Occurred())
+      return -1;
+    if (!set_parameter(engine->parameters, name, x)) {
+      PyErr_Format(PyExc_KeyError, "no parameter called %s", name);
+      return -1;
+    }
+    if (strcmp(name, "NUM_SHARDS") == 0 && x > 1.0) {
+      PyErr_SetString(PyExc_ValueError,
+		      "NUM_SHARDS > 1 isn't supported from Python");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static PyObject *
+Engine_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  EngineObject *self = (EngineObject *) type->tp_alloc(type, 0);
+  if (self == NULL)
+    return NULL;
+  self->engine = new Engine;
+  // Python programs can ask for what they want, so don't print reports
+  self->engine->reporter.out = nullptr;
+  self->exports = 0;
+  return (PyObject *) self;
+}
+
+static int
+Engine_init(EngineObject *self, PyObject *args, PyObject *kwds)
+{
+  if (PyTuple_Size(args) > 0) {
+    PyErr_SetString(PyExc_TypeError,
+		    "Engine() takes parameters as keyword arguments");
+    return -1;
+  }
+  return set_parameters(self->engine, kwds);
+}
+
+static void
+Engine_dealloc(EngineObject *self)
+{
+  delete self->engine;
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+// The engine's calls that can throw are made with the GIL released, so the
+// exception is caught there, and raised once the GIL is back
+static PyObject *
+engine_error(const std::string& message)
+{
+  PyErr_SetString(PyExc_ValueError, message.c_str());
+  return NULL;
+}
+
+static PyObject *
+Engine_create(EngineObject *self, PyObject *unused)
+{
+  // Recreating the agents would leave the columns pointing at freed memory
+  if (self->exports > 0) {
+    PyErr_SetString(PyExc_BufferError,
+		    "delete the agent column arrays before calling create()");
+    return NULL;
+  }
+  bool failed = false;
+  std::string message;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    self->engine->create();
+  } catch (const std::exception& e) { // e.g. out of memory
+    failed = true;
+    message = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (failed)
+    return engine_error(message);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+Engine_start(EngineObject *self, PyObject *unused)
+{
+  try {
+    self->engine->start();
+  } catch (const std::exception& e) { // e.g. a bad parameter
+    return engine_error(e.what());
+  }
+  Py_RETURN_NONE;
+}
+
+// Migration between regions moves the agents to new memory on every step
+static bool
+check_migration(EngineObject *self)
+{
+  if (self->exports > 0 && self->engine->regions.migrating()) {
+    PyErr_SetString(PyExc_BufferError, "delete the agent column arrays "
+		    "before stepping with MIGRATION_RATE > 0");
+    return false;
+  }
+  return true;
+}
+
+static PyObject *
+Engine_step(EngineObject *self, PyObject *unused)
+{
+  if (!check_migration(self))
+    return NULL;
+  bool more = false, failed = false;
+  std::string message;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    more = self->engine->step();
+  } catch (const std::exception& e) {
+    failed = true;
+    message = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (failed)
+    return engine_error(message);
+  return PyBool_FromLong(more);
+}
+
+static PyObject *
+Engine_simulate(EngineObject *self, PyObject *unused)
+{
+  if (!check_migration(self))
+    return NULL;
+  bool failed = false;
+  std::string message;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    self->engine->simulate();
+  } catch (const std::exception& e) {
+    failed = true;
+    message = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (failed)
+    return engine_error(message);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+Engine_set(EngineObject *self, PyObject *args, PyObject *kwds)
+{
+  if (PyTuple_Size(args) > 0) {
+    PyErr_SetString(PyExc_TypeError, "set() takes keyword arguments");
+    return NULL;
+  }
+  if (set_parameters(self->engine, kwds) < 0)
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+Engine_parameters(EngineObject *self, PyObject *unused)
+{
+  PyObject *result = PyDict_New();
+  if (result == NULL)
+    return NULL;
+  for (auto &p : self->engine->parameters) {
+    PyObject *value = PyFloat_FromDouble(p.second);
+    if (value == NULL || PyDict_SetItemString(result, p.first, value) < 0) {
+      Py_XDECREF(value);
+      Py_DECREF(result);
+      return NULL;
+    }
+    Py_DECREF(value);
+  }
+  return result;
+}
+
+static PyObject *
+Engine_summary(EngineObject *self, PyObject *args)
+{
+  int quantiles = 0;
+  if (!PyArg_ParseTuple(args, "|p", &quantiles))
+    return NULL;
+  Summary summary;
+  bool failed = false;
+  std::string message;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    summary = self->engine->summary(quantiles);
+  } catch (const std::exception& e) {
+    failed = true;
+    message = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (failed)
+    return engine_error(message);
+  PyObject *result =
+    Py_BuildValue("{s:n,s:I,s:(IIIIII),s:d,s:d,s:d}",
+		  "agents", (Py_ssize_t) summary.agents,
+		  "males", summary.males,
+		  "hiv", summary.hiv[0], summary.hiv[1], summary.hiv[2],
+		  summary.hiv[3], summary.hiv[4], summary.hiv[5],
+		  "average_age", summary.average_age(),
+		  "youngest", summary.youngest,
+		  "oldest", summary.oldest);
+  if (result != NULL && quantiles) {
+    PyObject *median = Py_BuildValue("(dd)", summary.ages.quantile(0.5),
+				     summary.stage_times.quantile(0.5));
+    if (median == NULL
+	|| PyDict_SetItemString(result, "median_age_and_stage_time",
+				median) < 0)
+      Py_CLEAR(result);
+    Py_XDECREF(median);
+  }
+  return result;
+}
+
+static PyObject *
+Engine_get_date(EngineObject *self, void *closure)
+{
+  return PyFloat_FromDouble(self->engine->date());
+}
+
+static PyObject *
+Engine_get_infected(EngineObject *self, void *closure)
+{
+  return PyLong_FromUnsignedLong(self->engine->infected());
+}
+
+static PyObject *
+Engine_get_prevalence(EngineObject *self, void *closure)
+{
+  return PyFloat_FromDouble(self->engine->prevalence());
+}
+
+static PyObject *
+Engine_get_steps(EngineObject *self, void *closure)
+{
+  std::vector<unsigned>& steps = self->engine->stepper.steps;
+  PyObject *result = PyList_New(steps.size());
+  if (result == NULL)
+    return NULL;
+  for (size_t i = 0; i < steps.size(); ++i) {
+    PyObject *step = PyLong_FromUnsignedLong(steps[i]);
+    if (step == NULL) {
+      Py_DECREF(result);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, i, step);
+  }
+  return result;
+}
+
+static PyObject *
+Engine_get_verbose(EngineObject *self, void *closure)
+{
+  return PyBool_FromLong(self->engine->reporter.out != nullptr);
+}
+
+static int
+Engine_set_verbose(EngineObject *self, PyObject *value, void *closure)
+{
+  int verbose = PyObject_IsTrue(value);
+  if (verbose < 0)
+    return -1;
+  self->engine->reporter.out = verbose ? &std::cout : nullptr;
+  return 0;
+}
+
+static PyMethodDef Engine_methods[] = {
+  {"create", (PyCFunction) Engine_create, METH_NOARGS,
+   "Create NUM_AGENTS agents, seeding the generator with SEED."},
+  {"start", (PyCFunction) Engine_start, METH_NOARGS,
+   "Get ready to simulate. Call after create() and after changing "
+   "parameters."},
+  {"step", (PyCFunction) Engine_step, METH_NOARGS,
+   "Do one time step. Returns False once the simulation is over."},
+  {"simulate", (PyCFunction) Engine_simulate, METH_NOARGS,
+   "Do all the remaining time steps."},
+  {"set", (PyCFunction) Engine_set, METH_VARARGS | METH_KEYWORDS,
+   "Set parameters, e.g. engine.set(NUM_YEARS=5)."},
+  {"parameters", (PyCFunction) Engine_parameters, METH_NOARGS,
+   "Return a dict of the parameters."},
+  {"summary", (PyCFunction) Engine_summary, METH_VARARGS,
+   "summary(quantiles=False): demographics of the agents as a dict."},
+  {NULL}
+};
+
+static PyGetSetDef Engine_getset[] = {
+  {(char *) "date", (getter) Engine_get_date, NULL,
+   (char *) "Current date", NULL},
+  {(char *) "infected", (getter) Engine_get_infected, NULL,
+   (char *) "Number of HIV+ agents", NULL},
+  {(char *) "prevalence", (getter) Engine_get_prevalence, NULL,
+   (char *) "Proportion of agents HIV+", NULL},
+  {(char *) "steps", (getter) Engine_get_steps, NULL,
+   (char *) "Size in ticks of each step taken", NULL},
+  {(char *) "verbose", (getter) Engine_get_verbose,
+   (setter) Engine_set_verbose,
+   (char *) "If true, reports are printed to stdout", NULL},
+  {(char *) "age", (getter) Engine_get_age, NULL,
+   (char *) "Age of each agent (float64 view)", NULL},
+  {(char *) "sex", (getter) Engine_get_sex, NULL,
+   (char *) "Sex of each agent, 0 = male (int32 view)", NULL},
+  {(char *) "hiv", (getter) Engine_get_hiv, NULL,
+   (char *) "HIV stage of each agent (uint32 view)", NULL},
+  {(char *) "risk", (getter) Engine_get_risk, NULL,
+   (char *) "Risk group of each agent (uint32 view)", NULL},
+  {(char *) "region", (getter) Engine_get_region, NULL,
+   (char *) "Region of each agent (uint32 view)", NULL},
+  {(char *) "x", (getter) Engine_get_x, NULL,
+   (char *) "x coordinate of each agent (float32 view)", NULL},
+  {(char *) "y", (getter) Engine_get_y, NULL,
+   (char *) "y coordinate of each agent (float32 view)", NULL},
+  {(char *) "stage_age", (getter) Engine_get_stage_age, NULL,
+   (char *) "Age each agent entered its HIV stage (float64 view)", NULL},
+  {NULL}
+};
+
+static PyModuleDef tutsimcc_module = {
+  PyModuleDef_HEAD_INIT,
+  "tutsimcc",
+  "Python interface to the C++ simulation in tutsim.hh",
+  -1,
+  NULL
+};
+
+PyMODINIT_FUNC
+PyInit_tutsimcc(void)
+{
+  ColumnType.tp_name = "tutsimcc.Column";
+  ColumnType.tp_basicsize = sizeof(ColumnObject);
+  ColumnType.tp_dealloc = (destructor) Column_dealloc;
+  ColumnType.tp_as_buffer = &Column_as_buffer;
+  ColumnType.tp_flags = Py_TPFLAGS_DEFAULT;
+  ColumnType.tp_doc = "A view of one field of every agent";
+  if (PyType_Ready(&ColumnType) < 0)
+    return NULL;
+
+  EngineType.tp_name = "tutsimcc.Engine";
+  EngineType.tp_basicsize = sizeof(EngineObject);
+  EngineType.tp_dealloc = (destructor) Engine_dealloc;
+  EngineType.tp_flags = Py_TPFLAGS_DEFAULT;
+  EngineType.tp_doc = "Engine(**parameters): a simulation";
+  EngineType.tp_methods = Engine_methods;
+  EngineType.tp_getset = Engine_getset;
+  EngineType.tp_init = (initproc) Engine_init;
+  EngineType.tp_new = Engine_new;
+  if (PyType_Ready(&EngineType) < 0)
+    return NULL;
+
+  PyObject *numpy = PyImport_ImportModule("numpy");
+  if (numpy != NULL) {
+    asarray = PyObject_GetAttrString(numpy, "asarray");
+    Py_DECREF(numpy);
+  }
+  if (asarray == NULL) {
+    PyErr_Clear();
+    asarray = Py_None;
+    Py_INCREF(asarray);
+  }
+
+  PyObject *module = PyModule_Create(&tutsimcc_module);
+  if (module == NULL)
+    return NULL;
+  Py_INCREF(&EngineType);
+  if (PyModule_AddObject(module, "Engine", (PyObject *) &EngineType) < 0) {
+    Py_DECREF(&EngineType);
+    Py_DECREF(module);
+    return NULL;
+  }
+  return module;
+}
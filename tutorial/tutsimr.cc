@@ -0,0 +1,461 @@
+// R interface to the simulation in tutsim.hh.
+//
+// Build with "make r", which leaves tutsimr.so in this directory, and use it
+// through the functions in tutsimr.R.
+//
+// An engine is an external pointer to a C++ Engine, so the agents stay in C++
+// memory and nothing is copied between steps. tutsim_agents() returns a
+// data.frame whose columns are ALTREP vectors that read the agents directly.
+// R functions that go through a vector a chunk at a time (sum, mean, range,
+// table, ...) never copy the column. Functions that need a plain C array
+// get a snapshot of the column at the time they ask for it, taken again each
+// time they ask.
+//
+// The columns always show the agents' current values, but the agents are
+// shuffled on every step, so row i isn't the same agent from one step to the
+// next. An R vector can't change its length, though, so a data.frame is for
+// the number of agents there were when tutsim_agents() made it. Once
+// tutsim_create() makes a different number, reading the old data.frame is an
+// error; call tutsim_agents() again.
+
+#include <cstddef> // offsetof
+#include <cstring> // memcpy, strncpy
+
+#include "tutsim.hh"
+
+// Don't let R's headers define macros like length() and error()
+#define R_NO_REMAP
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Altrep.h>
+#include <R_ext/Rdynload.h>
+
+// Engines
+
+// A C++ exception mustn't unwind through R's C code, and Rf_error() jumps
+// straight out of a function without running any destructors. So the entry
+// points that can throw (on a bad parameter, or when memory runs out) catch
+// the exception, copy its message into a buffer on the stack, and only call
+// Rf_error() once they're out of the try block.
+const size_t MESSAGE_SIZE = 256;
+
+static void
+keep_message(const std::exception& e, char (&message)[MESSAGE_SIZE])
+{
+  strncpy(message, e.what(), MESSAGE_SIZE - 1);
+  message[MESSAGE_SIZE - 1] = '\0';
+}
+
+static void
+finalize_engine(SEXP ptr)
+{
+  delete (Engine *) R_ExternalPtrAddr(ptr);
+  R_ClearExternalPtr(ptr);
+}
+
+static Engine *
+get_engine(SEXP ptr)
+{
+  if (TYPEOF(ptr) != EXTPTRSXP)
+    Rf_error("not a tutsim engine");
+  Engine *engine = (Engine *) R_ExternalPtrAddr(ptr);
+  if (engine == NULL)
+    Rf_error("this tutsim engine has been freed");
+  return engine;
+}
+
+// params is a named list of numbers
+static void
+set_parameters(Engine *engine, SEXP params)
+{
+  R_xlen_t n = Rf_xlength(params);
+  if (n == 0)
+    return;
+  SEXP names = Rf_getAttrib(params, R_NamesSymbol);
+  if (!Rf_isNewList(params) || Rf_isNull(names))
+    Rf_error("parameters must be a named list");
+  for (R_xlen_t i = 0; i < n; ++i) {
+    const char *name = CHAR(STRING_ELT(names, i));
+    double value = Rf_asReal(VECTOR_ELT(params, i));
+    if (!set_parameter(engine->parameters, name, value))
+      Rf_error("no parameter called %s", name);
+  }
+}
+
+extern "C" SEXP
+tutsim_new(SEXP params)
+{
+  Engine *engine = new Engine;
+  // R programs can ask for what they want, so don't print reports
+  engine->reporter.out = nullptr;
+  SEXP ptr = PROTECT(R_MakeExternalPtr(engine, Rf_install("tutsim_engine"),
+				       R_NilValue));
+  R_RegisterCFinalizerEx(ptr, finalize_engine, TRUE);
+  set_parameters(engine, params);
+  UNPROTECT(1);
+  return ptr;
+}
+
+extern "C" SEXP
+tutsim_set(SEXP ptr, SEXP params)
+{
+  set_parameters(get_engine(ptr), params);
+  return R_NilValue;
+}
+
+extern "C" SEXP
+tutsim_parameters(SEXP ptr)
+{
+  Engine *engine = get_engine(ptr);
+  R_xlen_t n = engine->parameters.size();
+  SEXP values = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, n));
+  R_xlen_t i = 0;
+  for (auto &p : engine->parameters) {
+    REAL(values)[i] = p.second;
+    SET_STRING_ELT(names, i, Rf_mkChar(p.first));
+    ++i;
+  }
+  Rf_setAttrib(values, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return values;
+}
+
+extern "C" SEXP
+tutsim_create(SEXP ptr)
+{
+  Engine *engine = get_engine(ptr);
+  char message[MESSAGE_SIZE] = "";
+  try {
+    engine->create();
+  } catch (const std::exception& e) {
+    keep_message(e, message);
+  }
+  if (message[0])
+    Rf_error("%s", message);
+  return R_NilValue;
+}
+
+extern "C" SEXP
+tutsim_start(SEXP ptr)
+{
+  Engine *engine = get_engine(ptr);
+  char message[MESSAGE_SIZE] = "";
+  try {
+    engine->start();
+  } catch (const std::exception& e) {
+    keep_message(e, message);
+  }
+  if (message[0])
+    Rf_error("%s", message);
+  return R_NilValue;
+}
+
+// Do up to n steps. Returns FALSE once the simulation is over.
+extern "C" SEXP
+tutsim_step(SEXP ptr, SEXP n)
+{
+  Engine *engine = get_engine(ptr);
+  int steps = Rf_asInteger(n);
+  bool more = true;
+  char message[MESSAGE_SIZE] = "";
+  for (int i = 0; i < steps && more; ++i) {
+    try {
+      more = engine->step();
+    } catch (const std::exception& e) {
+      keep_message(e, message);
+      break;
+    }
+    R_CheckUserInterrupt();
+  }
+  if (message[0])
+    Rf_error("%s", message);
+  return Rf_ScalarLogical(more);
+}
+
+extern "C" SEXP
+tutsim_simulate(SEXP ptr)
+{
+  Engine *engine = get_engine(ptr);
+  bool more = true;
+  char message[MESSAGE_SIZE] = "";
+  while (more) {
+    try {
+      more = engine->step();
+    } catch (const std::exception& e) {
+      keep_message(e, message);
+      break;
+    }
+    R_CheckUserInterrupt();
+  }
+  if (message[0])
+    Rf_error("%s", message);
+  return R_NilValue;
+}
+
+extern "C" SEXP
+tutsim_status(SEXP ptr)
+{
+  Engine *engine = get_engine(ptr);
+  SEXP result = PROTECT(Rf_allocVector(REALSXP, 3));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 3));
+  REAL(result)[0] = engine->date();
+  REAL(result)[1] = engine->infected();
+  REAL(result)[2] = engine->prevalence();
+  SET_STRING_ELT(names, 0, Rf_mkChar("date"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("infected"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("prevalence"));
+  Rf_setAttrib(result, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return result;
+}
+
+extern "C" SEXP
+tutsim_summary(SEXP ptr)
+{
+  Engine *engine = get_engine(ptr);
+  Summary summary = engine->summary(true);
+  const char *names[] = {"males", "youngest", "oldest", "average_age",
+			 "median_age", "median_stage_time", "hiv"};
+  const int n = sizeof(names) / sizeof(names[0]);
+  SEXP result = PROTECT(Rf_allocVector(VECSXP, n));
+  SEXP result_names = PROTECT(Rf_allocVector(STRSXP, n));
+  SET_VECTOR_ELT(result, 0, Rf_ScalarInteger(summary.males));
+  SET_VECTOR_ELT(result, 1, Rf_ScalarReal(summary.youngest));
+  SET_VECTOR_ELT(result, 2, Rf_ScalarReal(summary.oldest));
+  SET_VECTOR_ELT(result, 3, Rf_ScalarReal(summary.average_age()));
+  SET_VECTOR_ELT(result, 4, Rf_ScalarReal(summary.ages.quantile(0.5)));
+  SET_VECTOR_ELT(result, 5, Rf_ScalarReal(summary.stage_times.quantile(0.5)));
+  SEXP hiv = Rf_allocVector(INTSXP, 6);
+  SET_VECTOR_ELT(result, 6, hiv);
+  for (int i = 0; i < 6; ++i)
+    INTEGER(hiv)[i] = summary.hiv[i];
+  for (int i = 0; i < n; ++i)
+    SET_STRING_ELT(result_names, i, Rf_mkChar(names[i]));
+  Rf_setAttrib(result, R_NamesSymbol, result_names);
+  UNPROTECT(2);
+  return result;
+}
+
+// Columns
+
+// The fields of Agent that can be seen from R. Integer fields are shifted by
+// base, so that sex can be an R factor, whose codes start at 1. Real fields
+// are doubles, or floats if single is set.
+struct Field {
+  const char *name;
+  size_t offset;
+  bool real;
+  int base;
+  bool single;
+};
+
+static const Field fields[] = {
+  {"sex", offsetof(Agent, sex), false, 1},
+  {"age", offsetof(Agent, age), true, 0},
+  {"hiv", offsetof(Agent, hiv), false, 0},
+  {"risk", offsetof(Agent, risk), false, 0},
+  {"region", offsetof(Agent, region), false, 0},
+  {"x", offsetof(Agent, x), true, 0, true},
+  {"y", offsetof(Agent, y), true, 0, true},
+  {"stage_age", offsetof(Agent, stage_age), true, 0}
+};
+
+static R_altrep_class_t real_column;
+static R_altrep_class_t integer_column;
+
+// data1 of a column is an external pointer to its Field, whose tag is the
+// number of agents when the column was made and which protects the engine's
+// external pointer. data2 is R_NilValue until R asks for a plain C array,
+// and then it's the last snapshot, which is refilled on the next request.
+
+static const Field *
+column_field(SEXP x)
+{
+  return (const Field *) R_ExternalPtrAddr(R_altrep_data1(x));
+}
+
+static R_xlen_t
+Column_Length(SEXP x)
+{
+  return REAL(R_ExternalPtrTag(R_altrep_data1(x)))[0];
+}
+
+// The engine, as long as it still has the agents the column was made for
+static Engine *
+column_engine(SEXP x)
+{
+  Engine *engine = get_engine(R_ExternalPtrProtected(R_altrep_data1(x)));
+  if ((R_xlen_t) engine->agents.size() != Column_Length(x))
+    Rf_error("the number of agents has changed; call tutsim_agents() again");
+  return engine;
+}
+
+static double
+real_value(SEXP x, R_xlen_t i)
+{
+  const Agent& a = column_engine(x)->agents[i];
+  const char *field = (const char *) &a + column_field(x)->offset;
+  if (column_field(x)->single) {
+    float value;
+    memcpy(&value, field, sizeof value);
+    return value;
+  }
+  double value;
+  memcpy(&value, field, sizeof value);
+  return value;
+}
+
+static int
+integer_value(SEXP x, R_xlen_t i)
+{
+  int value;
+  const Agent& a = column_engine(x)->agents[i];
+  memcpy(&value, (const char *) &a + column_field(x)->offset, sizeof value);
+  return value + column_field(x)->base;
+}
+
+// A snapshot of the agents as they are now. The memory is reused from one
+// request to the next, since the length never changes.
+static void *
+Column_Dataptr(SEXP x, Rboolean writeable)
+{
+  R_xlen_t n = Column_Length(x);
+  column_engine(x); // Check before we read anything
+  SEXP snapshot = R_altrep_data2(x);
+  if (snapshot == R_NilValue) {
+    snapshot = Rf_allocVector(column_field(x)->real ? REALSXP : INTSXP, n);
+    R_set_altrep_data2(x, snapshot);
+  }
+  if (column_field(x)->real) {
+    for (R_xlen_t i = 0; i < n; ++i)
+      REAL(snapshot)[i] = real_value(x, i);
+    return REAL(snapshot);
+  }
+  for (R_xlen_t i = 0; i < n; ++i)
+    INTEGER(snapshot)[i] = integer_value(x, i);
+  return INTEGER(snapshot);
+}
+
+// There's no array that's always up to date, so R has to use Elt() and
+// Get_region() unless it really needs one
+static const void *
+Column_Dataptr_or_null(SEXP x)
+{
+  return NULL;
+}
+
+static double
+Column_real_Elt(SEXP x, R_xlen_t i)
+{
+  return real_value(x, i);
+}
+
+static int
+Column_integer_Elt(SEXP x, R_xlen_t i)
+{
+  return integer_value(x, i);
+}
+
+static R_xlen_t
+Column_real_Get_region(SEXP x, R_xlen_t start, R_xlen_t n, double *buffer)
+{
+  R_xlen_t length = Column_Length(x);
+  R_xlen_t count = start + n > length ? length - start : n;
+  for (R_xlen_t i = 0; i < count; ++i)
+    buffer[i] = real_value(x, start + i);
+  return count;
+}
+
+static R_xlen_t
+Column_integer_Get_region(SEXP x, R_xlen_t start, R_xlen_t n, int *buffer)
+{
+  R_xlen_t length = Column_Length(x);
+  R_xlen_t count = start + n > length ? length - start : n;
+  for (R_xlen_t i = 0; i < count; ++i)
+    buffer[i] = integer_value(x, start + i);
+  return count;
+}
+
+static SEXP
+make_column(SEXP ptr, const Field& field)
+{
+  SEXP length = PROTECT(Rf_ScalarReal(get_engine(ptr)->agents.size()));
+  SEXP field_ptr = PROTECT(R_MakeExternalPtr((void *) &field, length, ptr));
+  SEXP column = R_new_altrep(field.real ? real_column : integer_column,
+			     field_ptr, R_NilValue);
+  UNPROTECT(2);
+  return column;
+}
+
+// A data.frame of all the agents, like make_agents() in tutsim.R
+extern "C" SEXP
+tutsim_agents(SEXP ptr)
+{
+  Engine *engine = get_engine(ptr);
+  const int n = sizeof(fields) / sizeof(fields[0]);
+  SEXP result = PROTECT(Rf_allocVector(VECSXP, n));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, n));
+  for (int i = 0; i < n; ++i) {
+    SEXP column = make_column(ptr, fields[i]);
+    SET_VECTOR_ELT(result, i, column);
+    SET_STRING_ELT(names, i, Rf_mkChar(fields[i].name));
+    if (strcmp(fields[i].name, "sex") == 0) {
+      SEXP levels = PROTECT(Rf_allocVector(STRSXP, 2));
+      SET_STRING_ELT(levels, 0, Rf_mkChar("male"));
+      SET_STRING_ELT(levels, 1, Rf_mkChar("female"));
+      Rf_setAttrib(column, R_LevelsSymbol, levels);
+      Rf_setAttrib(column, R_ClassSymbol, Rf_mkString("factor"));
+      UNPROTECT(1);
+    }
+  }
+  Rf_setAttrib(result, R_NamesSymbol, names);
+  // Compact row names: c(NA, -n), which is why the columns can't grow
+  // or shrink
+  SEXP row_names = PROTECT(Rf_allocVector(INTSXP, 2));
+  INTEGER(row_names)[0] = NA_INTEGER;
+  INTEGER(row_names)[1] = - (int) engine->agents.size();
+  Rf_setAttrib(result, R_RowNamesSymbol, row_names);
+  Rf_setAttrib(result, R_ClassSymbol, Rf_mkString("data.frame"));
+  UNPROTECT(3);
+  return result;
+}
+
+// Registration
+
+static const R_CallMethodDef call_methods[] = {
+  {"tutsim_new", (DL_FUNC) &tutsim_new, 1},
+  {"tutsim_set", (DL_FUNC) &tutsim_set, 2},
+  {"tutsim_parameters", (DL_FUNC) &tutsim_parameters, 1},
+  {"tutsim_create", (DL_FUNC) &tutsim_create, 1},
+  {"tutsim_start", (DL_FUNC) &tutsim_start, 1},
+  {"tutsim_step", (DL_FUNC) &tutsim_step, 2},
+  {"tutsim_simulate", (DL_FUNC) &tutsim_simulate, 1},
+  {"tutsim_status", (DL_FUNC) &tutsim_status, 1},
+  {"tutsim_summary", (DL_FUNC) &tutsim_summary, 1},
+  {"tutsim_agents", (DL_FUNC) &tutsim_agents, 1},
+  {NULL, NULL, 0}
+};
+
+extern "C" void
+R_init_tutsimr(DllInfo *dll)
+{
+  real_column = R_make_altreal_class("tutsim_real_column", "tutsimr", dll);
+  R_set_altrep_Length_method(real_column, Column_Length);
+  R_set_altvec_Dataptr_method(real_column, Column_Dataptr);
+  R_set_altvec_Dataptr_or_null_method(real_column, Column_Dataptr_or_null);
+  R_set_altreal_Elt_method(real_column, Column_real_Elt);
+  R_set_altreal_Get_region_method(real_column, Column_real_Get_region);
+
+  integer_column = R_make_altinteger_class("tutsim_integer_column", "tutsimr",
+					   dll);
+  R_set_altrep_Length_method(integer_column, Column_Length);
+  R_set_altvec_Dataptr_method(integer_column, Column_Dataptr);
+  R_set_altvec_Dataptr_or_null_method(integer_column, Column_Dataptr_or_null);
+  R_set_altinteger_Elt_method(integer_column, Column_integer_Elt);
+  R_set_altinteger_Get_region_method(integer_column,
+				     Column_integer_Get_region);
+
+  R_registerRoutines(dll, NULL, call_methods, NULL, NULL);
+  R_useDynamicSymbols(dll, FALSE);
+}
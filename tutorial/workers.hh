@@ -0,0 +1,126 @@
+// A pool of threads that stay up for the whole simulation.
+//
+// Regions::for_each() splits the same work between the same threads on every
+// step, several times a step, and summarize() does on every report that needs
+// the agents. Starting a std::thread for each share costs a clone() and a
+// heap allocation every time, and a thread that's only going to live for one
+// share can't usefully be pinned next to its agents. Workers starts its
+// threads once, in Engine::start(), and then each run() just wakes them up
+// and waits for them all to finish.
+//
+// The job is passed as a plain function pointer and a pointer to the
+// caller's function object, not a std::function, so run() doesn't allocate.
+// Thread t runs job(t). The calling thread only waits, so with pinning (see
+// pin_thread() in placement.hh) worker t stays on the t-th CPU for good and
+// the calling thread is never pinned.
+
+#ifndef TUTSIM_WORKERS_HH
+#define TUTSIM_WORKERS_HH
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "placement.hh"
+
+class Workers {
+public:
+  Workers() {}
+  Workers(const Workers&) = delete;
+  Workers& operator=(const Workers&) = delete;
+
+  ~Workers()
+  {
+    stop();
+  }
+
+  unsigned size() const
+  {
+    return threads.size();
+  }
+
+  // Have n threads ready, pinned if pin is set. Does nothing if that's what
+  // there already are.
+  void start(const unsigned n, const bool pin)
+  {
+    if (n == threads.size() && pin == pinned)
+      return;
+    stop();
+    pinned = pin;
+    threads.reserve(n);
+    for (unsigned t = 0; t < n; ++t)
+      threads.push_back(std::thread(&Workers::loop, this, t, generation));
+  }
+
+  void stop()
+  {
+    if (threads.empty())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quitting = true;
+      ++generation;
+    }
+    wake.notify_all();
+    for (auto &t : threads)
+      t.join();
+    threads.clear();
+    quitting = false;
+  }
+
+  // Call f(t) in each thread t, and wait for them all to finish
+  template <class F> void run(F& f)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    job = &call<F>;
+    context = &f;
+    busy = threads.size();
+    ++generation;
+    wake.notify_all();
+    done.wait(lock, [this] { return busy == 0; });
+  }
+
+private:
+  std::vector<std::thread> threads;
+  bool pinned = false;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  // Everything below is guarded by mutex. Each run() (and stop()) adds one
+  // to generation, which is how a thread knows there's something new to do.
+  unsigned long generation = 0;
+  bool quitting = false;
+  void (*job)(void *, unsigned) = nullptr;
+  void *context = nullptr;
+  unsigned busy = 0;
+
+  template <class F> static void call(void *f, const unsigned t)
+  {
+    (*static_cast<F *>(f))(t);
+  }
+
+  void loop(const unsigned t, unsigned long seen)
+  {
+    if (pinned)
+      pin_thread(t);
+    for (;;) {
+      void (*work)(void *, unsigned);
+      void *f;
+      {
+	std::unique_lock<std::mutex> lock(mutex);
+	wake.wait(lock, [this, seen] { return generation != seen; });
+	seen = generation;
+	if (quitting)
+	  return;
+	work = job;
+	f = context;
+      }
+      work(f, t);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--busy == 0)
+	done.notify_one();
+    }
+  }
+};
+
+#endif